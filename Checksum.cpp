@@ -0,0 +1,23 @@
+#include "Checksum.h"
+
+/**
+ * @brief      Calculates a CRC-16/CCITT-FALSE checksum
+ *
+ * @param      data    Data to calculate the checksum over
+ * @param      length  Amount of bytes
+ * @param      crc     Initial value, or the result of the previous part of the data
+ *
+ * @return     Checksum
+ */
+uint16_t crc16(uint8_t const data[], uint32_t length, uint16_t crc)
+{
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
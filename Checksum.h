@@ -0,0 +1,9 @@
+#ifndef Checksum_h
+#define Checksum_h
+
+#include <stdint.h>
+
+// CRC-16/CCITT-FALSE, pass the previous result as crc to continue over several buffers
+uint16_t crc16(uint8_t const data[], uint32_t length, uint16_t crc = 0xFFFF);
+
+#endif
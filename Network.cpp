@@ -1,162 +1,1871 @@
 #include "Network.h"
 #include "Storage.h"
+#include "Checksum.h"
+#include "Config.h"
+
+#include <ctype.h>
+
+// HC-05 KEY pin, held high while sending AT commands
+#ifndef HC05_KEY_PIN
+#define HC05_KEY_PIN 9
+#endif
+
+// Baud rates supported by the HC-05, fastest first
+static uint32_t const _baud_rates[] = { 460800, 230400, 115200, 57600, 38400, 19200, 9600 };
+static uint8_t const _baud_rate_count = sizeof(_baud_rates) / sizeof(_baud_rates[0]);
 
 Network::Network()
 {
     // Initialize
     // Set default values for private members
     // adress and name of one module: +ADDR:98d3:34:910f91, name: +NAME:HC-05
+    this->window_size = NETWORK_WINDOW_SIZE;
+    this->baud_rate = 0;
+    this->state = NetworkState::network_idle;
+    this->transfer_size = 0;
+    this->transferred = 0;
+    this->framed = false;
+    this->resyncing = false;
+    this->chunk_size = NETWORK_CHUNK_SIZE;
 }
 
+/**
+ * @brief      Sets up the HC-05, to be called once from setup() before any transfer
+ *
+ * Blocks while the fastest working baud rate is probed, see Network::configureLink.
+ *
+ * @return     True on success, False if the module could not be configured
+ */
+bool Network::begin()
+{
+    pinMode(HC05_KEY_PIN, OUTPUT);
+    digitalWrite(HC05_KEY_PIN, LOW);
+    return configureLink(NETWORK_MAX_BAUD);
+}
 
 /**
- * @brief      Download file from currently connected node.
+ * @brief      Sends an AT command to the HC-05 and waits for the response
  *
- * @param      filepath The filename/path of the file
- * @param      push 1 = download pushed file from remote node, 0 = download normal file after requesting it from remote node
+ * The KEY pin has to be held high for the module to interpret the command.
+ *
+ * @param      command  Command to send without line ending
+ * @param      timeout  Milliseconds to wait for the response
+ *
+ * @return     True if the module responded with OK, False otherwise
  */
-void Network::downloadFile(char filepath[], bool push)
+static bool _sendATCommand(char const command[], uint32_t timeout = 200)
 {
-    // If routine download request (not servicing a push request)
-    // Send download command to node
-    // Send filepath to node
-    if (!push) {
-        Serial1.write(DOWNLOAD_FILE);
-        Serial1.print(filepath);
+    // Throw away anything left over from earlier
+    while (NETWORK_SERIAL.available() > 0)
+    {
+        NETWORK_SERIAL.read();
     }
 
-    // Let remote node know that you are ready
-    Serial1.write(READY);
-	Serial.print("Beginning download...\n");
-    // Wait for remote node to send you file size
-    // Receive how many bytes the file is going to be
-	// Serial1 for bluetooth (arduino ports 18,19)
-    while (Serial1.available() <= 0) // Could add a timer here to enforce a timeout
+    NETWORK_SERIAL.print(command);
+    NETWORK_SERIAL.print("\r\n");
+
+    // Look for "OK" or "ERROR" in the response
+    uint32_t const started = millis();
+    char previous = '\0';
+    while (millis() - started < timeout)
+    {
+        if (NETWORK_SERIAL.available() <= 0)
+        {
+            continue;
+        }
+        char const c = NETWORK_SERIAL.read();
+        if (previous == 'O' && c == 'K')
+        {
+            return true;
+        }
+        if (previous == 'E' && c == 'R')
+        {
+            return false;
+        }
+        previous = c;
+    }
+    return false;
+}
+
+/**
+ * @brief      Finds the baud rate the HC-05 is currently configured to
+ *
+ * @return     Baud rate, 0 if the module did not respond at any rate
+ */
+uint32_t Network::detectBaudRate()
+{
+    digitalWrite(HC05_KEY_PIN, HIGH);
+    for (uint8_t i = 0; i < _baud_rate_count; ++i)
     {
-        1;
+        NETWORK_SERIAL.begin(_baud_rates[i]);
+        if (_sendATCommand("AT"))
+        {
+            digitalWrite(HC05_KEY_PIN, LOW);
+            return _baud_rates[i];
+        }
     }
-	uint32_t size_of_file = Serial1.read();
+    digitalWrite(HC05_KEY_PIN, LOW);
+    return 0;
+}
+
+/**
+ * @brief      Switches the HC-05 and Serial1 to a baud rate and checks that the link holds
+ *
+ * The module has to be reachable at this->baud_rate beforehand.
+ *
+ * @param      baud_rate  Baud rate to switch to
+ *
+ * @return     True if every probe succeeded at the new rate, False otherwise
+ */
+bool Network::applyBaudRate(uint32_t baud_rate)
+{
+    char command[24] = "AT+UART=";
+    ultoa(baud_rate, command + strlen(command), 10);
+    strcat(command, ",0,0");
 
-    // Start saving the received bytes to the SD card with the filename
-    if (!Storage::instance().fileOpenToWrite(filepath, true)) // true = overwrite existing
+    digitalWrite(HC05_KEY_PIN, HIGH);
+    NETWORK_SERIAL.begin(this->baud_rate);
+    if (!_sendATCommand(command))
     {
-        Serial.println("Failed to open the file for writing!");
-        Serial.println("Aborting download procedure!");
-        return;
+        digitalWrite(HC05_KEY_PIN, LOW);
+        return false;
+    }
+
+    // New rate is taken into use on reset, leave AT mode while the module reboots
+    NETWORK_SERIAL.print("AT+RESET\r\n");
+    NETWORK_SERIAL.flush();
+    digitalWrite(HC05_KEY_PIN, LOW);
+    delay(1000);
+    this->baud_rate = baud_rate;
+    NETWORK_SERIAL.begin(baud_rate);
+
+    // Probe the link at the new rate
+    digitalWrite(HC05_KEY_PIN, HIGH);
+    bool stable = true;
+    for (uint8_t i = 0; i < NETWORK_LINK_PROBES && stable; ++i)
+    {
+        stable = _sendATCommand("AT");
+    }
+    digitalWrite(HC05_KEY_PIN, LOW);
+    return stable;
+}
+
+/**
+ * @brief      Configures the HC-05 and Serial1 to the highest baud rate that works
+ *
+ * Each rate is proven with NETWORK_LINK_PROBES AT commands before it is used,
+ * otherwise the next slower rate is tried.
+ *
+ * @param      max_baud  Highest baud rate to try
+ *
+ * @return     True on success, False if the module could not be configured
+ */
+bool Network::configureLink(uint32_t max_baud)
+{
+    Serial.println("Configuring Bluetooth link...");
+
+    for (uint8_t i = 0; i < _baud_rate_count; ++i)
+    {
+        if (_baud_rates[i] > max_baud)
+        {
+            continue;
+        }
+
+        // Module might have been left at an unknown rate by earlier failures
+        if (this->baud_rate == 0)
+        {
+            this->baud_rate = detectBaudRate();
+            if (this->baud_rate == 0)
+            {
+                Serial.println("HC-05 did not respond to AT commands!");
+                return false;
+            }
+        }
+
+        if (this->baud_rate == _baud_rates[i] || applyBaudRate(_baud_rates[i]))
+        {
+            NETWORK_SERIAL.begin(_baud_rates[i]);
+            this->baud_rate = _baud_rates[i];
+            Serial.print("...Bluetooth link running at ");
+            Serial.println(this->baud_rate);
+            return true;
+        }
+        this->baud_rate = 0;
+    }
+
+    Serial.println("Failed to configure Bluetooth link!");
+    return false;
+}
+
+/**
+ * @brief      Falls back to the next slower baud rate, for use after an unstable transfer
+ *
+ * @return     True on success, False if already at the slowest rate or reconfiguring failed
+ */
+bool Network::degradeLink()
+{
+    for (uint8_t i = 0; i + 1 < _baud_rate_count; ++i)
+    {
+        if (_baud_rates[i] == this->baud_rate)
+        {
+            return configureLink(_baud_rates[i + 1]);
+        }
     }
+    return false;
+}
+
+/**
+ * @brief      Returns the baud rate used between Serial1 and the HC-05
+ *
+ * @return     Baud rate, 0 if the link is not configured
+ */
+uint32_t Network::getBaudRate()
+{
+    return this->baud_rate;
+}
 
-    // Start saving the file to the SD card	
-	uint8_t buffer[200];
-	
-    for (uint32_t i = 0; i < size_of_file;)
+/**
+ * @brief      Reads a requested amount of bytes from the remote node
+ *
+ * The bytes have to be available already.
+ *
+ * @param      buffer  Buffer to read into
+ * @param      amount  Amount of bytes to read
+ */
+static void _readBytes(uint8_t buffer[], uint16_t amount)
+{
+    for (uint16_t i = 0; i < amount; ++i)
     {
-        // Send 'READY' message to remote node
-        Serial1.write(READY);
+        buffer[i] = NETWORK_SERIAL.read();
+    }
+}
 
-        // Wait for the remote node to respond
-        while (Serial1.available() <= 0) // Could add a timer here to enforce a timeout
+/**
+ * @brief      Waits until a requested amount of bytes is available from the remote node
+ *
+ * @param      amount   Amount of bytes, at most the size of the Serial1 receive buffer
+ * @param      timeout  Milliseconds to wait
+ *
+ * @return     True if the bytes are available, False on timeout
+ */
+static bool _waitForBytes(uint16_t amount, uint32_t timeout = NETWORK_TIMEOUT_MS)
+{
+    uint32_t const started = millis();
+    while (NETWORK_SERIAL.available() < (int)amount)
+    {
+        if (millis() - started >= timeout)
         {
-            1;
+            Serial.println("Remote node timed out!");
+            return false;
         }
+    }
+    return true;
+}
 
-        //Receive 200 bytes from the node
-        //buffer should be filled with the 200 bytes
-		    
-        for (int z=0; z<200; z++){
-  			buffer[z]=Serial1.read();
+/**
+ * @brief      Reads a NUL terminated string from the remote node
+ *
+ * Characters that don't fit into the buffer are skipped.
+ *
+ * @param      buffer  Buffer to read into
+ * @param      size    Size of the buffer
+ *
+ * @return     True on success, False on timeout
+ */
+static bool _readString(char buffer[], uint16_t size)
+{
+    uint16_t length = 0;
+    while (_waitForBytes(1))
+    {
+        char const c = NETWORK_SERIAL.read();
+        if (c == '\0')
+        {
+            buffer[length] = '\0';
+            return true;
+        }
+        if (length + 1 < size)
+        {
+            buffer[length++] = c;
         }
+    }
+    return false;
+}
+
+/**
+ * @brief      Moves received bytes from Serial1 into the chunk buffers
+ *
+ * @param      chunks  Amount of chunks that may be received in total
+ *
+ * @return     True if any bytes were received, False otherwise
+ */
+bool Network::drainChunks(uint32_t chunks)
+{
+    // Framed chunks are wrapped in a sequence number and a CRC
+    uint16_t const frame_size = this->framed ? NETWORK_FRAME_SIZE : this->chunk_size;
+    uint16_t const data_start = this->framed ? 2 : 0;
 
-        // Save the 200 bytes to the SD card
-        if ((size_of_file - i) < 200)
-           Storage::instance().fileWriteData(buffer, size_of_file - i);
+    uint16_t drained = 0;
+    while (this->rx_received < chunks && !this->resyncing && NETWORK_SERIAL.available() > 0)
+    {
+        uint8_t const c = NETWORK_SERIAL.read();
+        if (this->rx_position < data_start)
+        {
+            this->frame_fields[this->rx_position] = c;
+        }
+        else if (this->rx_position < data_start + this->chunk_size)
+        {
+            this->rx_buffers[this->rx_received % NETWORK_RX_BUFFERS][this->rx_position - data_start] = c;
+        }
         else
-           Storage::instance().fileWriteData(buffer, 200);
+        {
+            this->frame_fields[this->rx_position - this->chunk_size] = c;
+        }
 
-        // Written the current i bytes of the file, so advance counter by as much
-        i += 200;
+        if (++this->rx_position == frame_size)
+        {
+            this->rx_position = 0;
+            if (!this->framed || frameValid())
+            {
+#if STATS_ENABLED
+                STAT_TIME(stat_chunk_latency, this->chunk_credited[this->rx_received % NETWORK_RX_BUFFERS]);
+#endif
+                STAT_COUNT(stat_net_chunks, 1);
+                this->rx_received++;
+            }
+            else
+            {
+                beginResync();
+            }
+        }
+        drained++;
+    }
+    STAT_COUNT(stat_net_rx_bytes, drained);
+    return drained > 0;
+}
 
-	}
+/**
+ * @brief      Checks the sequence number and CRC of the framed chunk just received
+ *
+ * @return     True if the chunk is the expected one and arrived intact, False otherwise
+ */
+bool Network::frameValid()
+{
+    uint16_t const sequence = this->frame_fields[0] | ((uint16_t)this->frame_fields[1] << 8);
+    uint16_t const crc = this->frame_fields[2] | ((uint16_t)this->frame_fields[3] << 8);
+    if (sequence != (uint16_t)this->rx_received)
+    {
+        return false;
+    }
+    uint16_t const expected = crc16(this->frame_fields, 2);
+    return crc == crc16(this->rx_buffers[this->rx_received % NETWORK_RX_BUFFERS], NETWORK_CHUNK_SIZE, expected);
+}
 
-	Serial.print("Download completed successfully...\n");
+/**
+ * @brief      Builds the path of the temporary file the running download is saved to
+ *
+ * Framed downloads include the tag of the file, so that only a partial download of
+ * the same version of the file is ever resumed.
+ *
+ * @param      part_path  Buffer of at least sizeof(transfer_path) + 10 characters
+ */
+void Network::getPartPath(char part_path[])
+{
+    strcpy(part_path, this->transfer_path);
+    if (this->framed)
+    {
+        char tag[6] = ".";
+        utoa(this->transfer_tag, tag + 1, 16);
+        strcat(part_path, tag);
+    }
+    strcat(part_path, NETWORK_PART_SUFFIX);
+}
 
-	
-    // Finally close the file handle
-    Storage::instance().fileClose();
+/**
+ * @brief      Sets the amount of chunks allowed in flight during a transfer
+ *
+ * The receiving side is further limited to NETWORK_RX_BUFFERS chunks.
+ *
+ * @param      window_size  Amount of chunks, clamped to 1-31. 1 = stop-and-wait.
+ */
+void Network::setWindowSize(uint8_t window_size)
+{
+    if (window_size < 1)
+        window_size = 1;
+    if (window_size > NETWORK_WINDOW_MASK)
+        window_size = NETWORK_WINDOW_MASK;
+    this->window_size = window_size;
 }
 
 /**
- * @brief      Upload file to currently connected node.
+ * @brief      Moves the transfer into a new state
  *
- * @param      filepath The filename/path of the file
- * @param      push 1 = push upload file to remote node, 0 = upload file to remote node upon receiving download request
+ * @param      state    State to move into
+ * @param      timeout  Milliseconds the state may last without progress
  */
-void Network::uploadFile(char filepath[], bool push)
+void Network::enterState(NetworkState state, uint32_t timeout)
 {
-    uint8_t msg = '$';
+    this->state = state;
+    this->state_timeout = timeout;
+    this->state_started = millis();
+    this->retries = 0;
+}
 
-    // Open the file and get size
-    if (!Storage::instance().fileOpenToRead(filepath))
+/**
+ * @brief      Checks whether the current state has lasted too long without progress
+ *
+ * Each expiry counts as a retry and restarts the deadline, until NETWORK_RETRIES
+ * retries have been used up and the transfer fails. The link then falls back to
+ * the next slower baud rate for the transfers that follow.
+ *
+ * @return     True if the deadline passed, False otherwise
+ */
+bool Network::stateExpired()
+{
+    if (millis() - this->state_started < this->state_timeout)
     {
-        Serial.println("Failed to open file for uploading!");
-        Serial.println("Aborting upload procedure!");
-        return;
+        return false;
     }
-    uint32_t size_of_file = Storage::instance().fileSize();
-	
-    // Send upload command to node with the file size so that it knows how many bytes to save
-    if (push) { //if file is to be pushed, also send filepath first
-        Serial1.write(UPLOAD_FILE);
-        Serial1.print(filepath);
+
+    this->state_started = millis();
+    STAT_COUNT(stat_net_retries, 1);
+    if (++this->retries > NETWORK_RETRIES)
+    {
+        Serial.println("Remote node timed out!");
+        Serial.println("Aborting transfer!");
+        abortTransfer();
+        degradeLink();
+    }
+    return true;
+}
+
+/**
+ * @brief      Restarts the deadline of the current state after progress
+ */
+void Network::stateProgressed()
+{
+    this->state_started = millis();
+    this->retries = 0;
+}
+
+/**
+ * @brief      Starts downloading a file from currently connected node, see Network::poll
+ *
+ * Commands are sent as a NetworkFrame followed by the filepath. The receiver
+ * always answers with 'READY', followed by READY_WINDOWED and the window size.
+ * A node supporting the window responds with a NetworkFrame of WINDOW_ACK, holding
+ * the accepted window in its flags and the file size as its length, after which up
+ * to window chunks are streamed and every received chunk is credited with one 'READY'
+ * as soon as a buffer is free for it. Nodes predating NetworkFrame respond
+ * with WINDOW_ACK, the accepted window and a 32-bit little-endian file size instead.
+ * Older nodes ignore the request and respond with the file size as text, in which case
+ * one 'READY' is sent per chunk as before.
+ *
+ * The window request also carries NETWORK_FLAG_FRAMED. A node supporting framed chunks
+ * sets the flag in its WINDOW_ACK and follows it with a 16-bit tag of the file, then
+ * waits for 'READY_RESUME' and a 32-bit little-endian offset to start sending from,
+ * which grants a full window. Every chunk is then preceded by its 16-bit sequence
+ * number and followed by a CRC16 of both. A chunk that arrives out of order or
+ * damaged, or a stall, is answered with 'CHUNK_NAK'. The sender stops, the receiver
+ * throws away whatever is still in flight until the line has been quiet for
+ * NETWORK_RESYNC_MS and then resumes the transfer from the first missing chunk. A final
+ * 'READY_RESUME' with the end offset confirms that the whole file was saved.
+ *
+ * Downloads are saved to a temporary .part file that replaces filepath once complete,
+ * preallocated to the file size so that chunks are written without FAT updates.
+ * An interrupted framed download leaves its .part file behind, and the next download
+ * of the same version of the file resumes from the last full chunk saved in it.
+ *
+ * An encoded download transfers the .cbm of a bitmap instead of the bitmap itself,
+ * and is stored as the encoded version of filepath. The remote node services
+ * DOWNLOAD_ENCODED with uploadFile(filepath, false, true) and UPLOAD_ENCODED with
+ * downloadFile(filepath, true, true).
+ *
+ * @param      filepath The filename/path of the file
+ * @param      push 1 = download pushed file from remote node, 0 = download normal file after requesting it from remote node
+ * @param      encoded 1 = download the encoded version of the bitmap
+ *
+ * @return     True if the download was started, False if another transfer is running
+ */
+bool Network::startDownload(char filepath[], bool push, bool encoded)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+    // If routine download request (not servicing a push request)
+    // Send download command to node
+    // Send filepath to node
+    if (!push) {
+        sendFrame(encoded ? DOWNLOAD_ENCODED : DOWNLOAD_FILE, 0, strlen(filepath));
+        NETWORK_SERIAL.print(filepath);
     }
 
-	Serial.print("Waiting for 'READY'\n");
-	
-    // Wait for remote node to respond with 'READY' and then transmit file size
-    while (Serial1.available() <= 0)  // Could add a timer here to enforce a timeout
+    // Encoded bitmaps are saved directly where Storage looks for them
+    if (encoded)
     {
-        1;
+        Storage::instance().getEncodedPath(filepath, this->transfer_path);
     }
-    msg = Serial1.read();
-	
-	Serial.print("Message received: " + msg + '\n');
-	
-    if (msg == READY){
-        Serial1.print(size_of_file);
-		Serial.print("Size of file being sent is: " + size_of_file + '\n');
+    else
+    {
+        strncpy(this->transfer_path, filepath, sizeof(this->transfer_path) - 1);
+        this->transfer_path[sizeof(this->transfer_path) - 1] = '\0';
     }
-	else {
-        Serial.println("Remote node did not respond with 'READY'!");
-        Serial.println("Aborting upload procedure!");
-        return;
+    this->transfer_size = 0;
+    this->transferred = 0;
+    this->framed = false;
+    this->resyncing = false;
+    this->text_received = 0;
+    this->chunk_size = NETWORK_CHUNK_SIZE;
+
+    // Let remote node know that you are ready
+    Serial.print("Beginning download...\n");
+    sendReady();
+    enterState(NetworkState::download_wait_size, NETWORK_TIMEOUT_MS);
+    return true;
+}
+
+/**
+ * @brief      Sends the NetworkFrame heading a command or the file size
+ *
+ * @param      command  Command of the frame
+ * @param      flags    Command specific flags
+ * @param      length   Amount of bytes following the frame, or the size of the file for WINDOW_ACK
+ */
+void Network::sendFrame(uint8_t command, uint8_t flags, uint32_t length)
+{
+    NetworkFrame const frame = { { NETWORK_MAGIC_0, NETWORK_MAGIC_1 }, command, flags, length };
+    NETWORK_SERIAL.write((uint8_t const *)&frame, sizeof(frame));
+}
+
+/**
+ * @brief      Sends 'READY' to start a download, together with the window request
+ */
+void Network::sendReady()
+{
+    // Window size is sent with the high bit set so that it is never mistaken for 'READY'
+    NETWORK_SERIAL.write(READY);
+    uint8_t const window_size = min(min(this->window_size, NETWORK_RX_BUFFERS), NETWORK_WINDOW_MASK);
+    NETWORK_SERIAL.write(READY_WINDOWED);
+    NETWORK_SERIAL.write(0x80 | NETWORK_FLAG_FRAMED | NETWORK_FLAG_HEADER | window_size);
+}
+
+/**
+ * @brief      Tells the remote node to continue a framed transfer from the first chunk not yet received
+ *
+ * The resumed transfer is granted a full window.
+ */
+void Network::sendResume()
+{
+    uint32_t const offset = this->rx_received * NETWORK_CHUNK_SIZE;
+    uint8_t const message[5] = { READY_RESUME, (uint8_t)offset, (uint8_t)(offset >> 8),
+                                 (uint8_t)(offset >> 16), (uint8_t)(offset >> 24) };
+    NETWORK_SERIAL.write(message, 5);
+    this->requested = min(this->chunks, this->rx_received + this->window);
+    this->resyncing = false;
+    stampCredited(this->rx_received);
+}
+
+/**
+ * @brief      Remembers when chunks were credited to the remote node, to measure their latency
+ *
+ * @param      from  First chunk credited, up to the amount of chunks requested
+ */
+void Network::stampCredited(uint32_t from)
+{
+#if STATS_ENABLED
+    uint32_t const now = micros();
+    for (uint32_t i = from; i < this->requested; ++i)
+    {
+        this->chunk_credited[i % NETWORK_RX_BUFFERS] = now;
     }
-    // Start sending data
-    uint8_t buffer[200];
+#endif
+}
+
+/**
+ * @brief      Stops the remote node after a bad chunk, see Network::startDownload
+ */
+void Network::beginResync()
+{
+    STAT_COUNT(stat_net_naks, 1);
+    NETWORK_SERIAL.write(CHUNK_NAK);
+    this->resyncing = true;
+    this->rx_position = 0;
+    this->resync_started = millis();
+}
 
-    for (uint32_t i = 0; i < size_of_file;) // Increment i by 200 due to sending 200 bytes at a time
+/**
+ * @brief      Takes the file size sent as text by an older node from the bytes received after 'READY'
+ *
+ * Older nodes answer every byte after 'READY' with a chunk, so the size is followed
+ * right away by the chunks granted by Network::sendReady, and a chunk starting with
+ * digits can't be told apart from the size. The amount of bytes received tells how
+ * many chunks were sent and so how many digits the size has. The chunks are left in
+ * rx_buffers as received.
+ *
+ * @return     True if the size matches the amount of chunks received, False otherwise
+ */
+bool Network::splitTextSize()
+{
+    // sendReady grants two chunks, fewer if the file is smaller
+    for (int8_t granted = 2; granted >= 0; --granted)
     {
-        // Wait for 'READY' message from remote node
-        msg = '$';
-        while (Serial1.available() <= 0)    // Could add a timer here to enforce a timeout
+        int16_t const digits = (int16_t)this->text_received - granted * NETWORK_LEGACY_CHUNK_SIZE;
+        if (digits < 1 || digits > 10)
         {
-            1;
+            continue;
         }
-        msg = Serial1.read();
-        if (msg == READY);
+        uint32_t size = 0;
+        bool numeric = true;
+        for (int16_t i = 0; i < digits; ++i)
         {
-            // Read 200 bytes from Storage
-            Storage::instance().fileReadData(buffer, 200);
-
-            // Send the 200 bytes
-            for (int z = 0; z < 200; z++) {
-                Serial1.write(buffer[z]);
-            }
+            numeric = numeric && isdigit(this->rx_buffers[0][i]);
+            size = size * 10 + (this->rx_buffers[0][i] - '0');
+        }
+        uint32_t const chunks = (size + NETWORK_LEGACY_CHUNK_SIZE - 1) / NETWORK_LEGACY_CHUNK_SIZE;
+        if (!numeric || min(chunks, (uint32_t)2) != (uint32_t)granted)
+        {
+            continue;
+        }
 
-            // Read and sent the current i bytes of the file, so advance counter by as much
-            i += 200;
+        // Move the chunks to the start of their buffers, the second first as it lies behind the first
+        if (granted == 2)
+        {
+            memcpy(this->rx_buffers[1], this->rx_buffers[0] + digits + NETWORK_LEGACY_CHUNK_SIZE, NETWORK_LEGACY_CHUNK_SIZE);
         }
+        memmove(this->rx_buffers[0], this->rx_buffers[0] + digits, NETWORK_LEGACY_CHUNK_SIZE);
+        this->transfer_size = size;
+        this->window = 1;
+        this->chunk_size = NETWORK_LEGACY_CHUNK_SIZE;
+        this->chunks = chunks;
+        this->requested = granted;
+        this->rx_received = granted;
+        this->rx_position = 0;
+        STAT_COUNT(stat_net_chunks, granted);
+        STAT_COUNT(stat_net_rx_bytes, this->text_received);
+        return true;
     }
-
-    // Finally close the file handle
-    Storage::instance().fileClose();
+    return false;
 }
 
+/**
+ * @brief      Waits for the remote node to send the file size, then opens the file to save to
+ */
+void Network::pollDownloadSize()
+{
+    // Receive how many bytes the file is going to be
+    // Serial1 for bluetooth (arduino ports 18,19)
+    if (this->chunk_size == NETWORK_LEGACY_CHUNK_SIZE)
+    {
+        // Receive the chunks already granted to an older node before the SD card gets busy
+        if (drainChunks(this->requested))
+        {
+            stateProgressed();
+        }
+        if (this->rx_received < this->requested)
+        {
+            stateExpired();
+            return;
+        }
+    }
+    else if (!this->framed)
+    {
+        // Looked at once, as bytes arriving in between would take the wrong branch
+        int const available = NETWORK_SERIAL.available();
+        if (this->text_received > 0 || (available > 0 && isdigit(NETWORK_SERIAL.peek())))
+        {
+            // Older nodes send the size as text and the chunks granted by sendReady straight after it,
+            // so everything is kept until the line goes quiet and split up afterwards
+            bool progressed = false;
+            while (NETWORK_SERIAL.available() > 0 && this->text_received < sizeof(this->rx_buffers[0]))
+            {
+                this->rx_buffers[0][this->text_received++] = NETWORK_SERIAL.read();
+                progressed = true;
+            }
+            if (progressed)
+            {
+                stateProgressed();
+                return;
+            }
+            if (millis() - this->state_started < NETWORK_NEGOTIATE_MS)
+            {
+                return;
+            }
+            if (!splitTextSize())
+            {
+                Serial.println("Remote node did not answer with the file size!");
+                Serial.println("Aborting download procedure!");
+                abortTransfer();
+                return;
+            }
+            stateProgressed();
+            return;
+        }
+        else if (available <= 0)
+        {
+            // The remote node might have missed 'READY'
+            if (stateExpired() && this->state == NetworkState::download_wait_size)
+            {
+                sendReady();
+            }
+            return;
+        }
+        else if (NETWORK_SERIAL.peek() == NETWORK_MAGIC_0)
+        {
+            if (NETWORK_SERIAL.available() < (int)sizeof(NetworkFrame))
+            {
+                stateExpired();
+                return;
+            }
+            NetworkFrame frame;
+            _readBytes((uint8_t *)&frame, sizeof(frame));
+            if (frame.magic[1] != NETWORK_MAGIC_1 || frame.command != WINDOW_ACK)
+            {
+                Serial.println("Remote node did not answer with the file size!");
+                Serial.println("Aborting download procedure!");
+                abortTransfer();
+                return;
+            }
+            this->window = max(frame.flags & NETWORK_WINDOW_MASK, 1);
+            this->framed = (frame.flags & NETWORK_FLAG_FRAMED) != 0;
+            this->transfer_size = frame.length;
+        }
+        else if (NETWORK_SERIAL.peek() == WINDOW_ACK)
+        {
+            if (NETWORK_SERIAL.available() < 6)
+            {
+                stateExpired();
+                return;
+            }
+            uint8_t header[6];
+            _readBytes(header, 6);
+            this->window = max(header[1] & NETWORK_WINDOW_MASK, 1);
+            this->framed = (header[1] & NETWORK_FLAG_FRAMED) != 0;
+            this->transfer_size =
+                ((uint32_t)header[2]) +
+                ((uint32_t)header[3] << 8) +
+                ((uint32_t)header[4] << 16) +
+                ((uint32_t)header[5] << 24);
+        }
+        else
+        {
+            Serial.println("Remote node did not answer with the file size!");
+            Serial.println("Aborting download procedure!");
+            abortTransfer();
+            return;
+        }
+    }
+
+    int32_t offset = 0;
+    this->chunks = (this->transfer_size + this->chunk_size - 1) / this->chunk_size;
+    char part_path[sizeof(this->transfer_path) + 10];
+    if (this->framed)
+    {
+        // Framed senders follow the size with the tag of the file
+        if (NETWORK_SERIAL.available() < 2)
+        {
+            stateExpired();
+            return;
+        }
+        uint8_t tag[2];
+        _readBytes(tag, 2);
+        this->transfer_tag = tag[0] | ((uint16_t)tag[1] << 8);
+
+        // Continue an earlier partial download of the same file
+        // A part file of full size might be preallocated space that was never written
+        getPartPath(part_path);
+        bool const partial = Storage::instance().fileOpenToRead(part_path) &&
+                             Storage::instance().fileSize() < this->transfer_size;
+        offset = partial ? Storage::instance().fileOpenToResume(part_path, NETWORK_CHUNK_SIZE) : 0;
+    }
+    else
+    {
+        getPartPath(part_path);
+    }
+    if (offset == 0)
+    {
+        offset = Storage::instance().fileOpenToWritePreallocated(part_path, this->transfer_size) ? 0 : -1;
+    }
+
+    // Start saving the received bytes to the SD card
+    if (offset < 0)
+    {
+        Serial.println("Failed to open the file for writing!");
+        Serial.println("Aborting download procedure!");
+        abortTransfer();
+        return;
+    }
+    if (offset > 0)
+    {
+        Serial.print("Resuming download from ");
+        Serial.println(offset);
+    }
+
+    this->committed = offset / this->chunk_size;
+    this->commit_position = 0;
+    this->transferred = min((uint32_t)offset, this->transfer_size);
+    if (this->framed)
+    {
+        // A completed download is confirmed once it has been renamed
+        this->rx_received = this->committed;
+        this->rx_position = 0;
+        this->requested = this->committed;
+        if (this->committed < this->chunks)
+        {
+            sendResume();
+        }
+    }
+    else if (this->chunk_size != NETWORK_LEGACY_CHUNK_SIZE)
+    {
+        // A windowed sender has already been granted the first chunks
+        this->rx_received = 0;
+        this->rx_position = 0;
+        this->requested = (this->window > 1) ? min(this->chunks, (uint32_t)this->window) : 0;
+        stampCredited(0);
+    }
+    enterState(NetworkState::download_receive, NETWORK_TIMEOUT_MS);
+}
+
+/**
+ * @brief      Receives chunks and saves at most one sector or slice of them to the SD card
+ *
+ * Chunks are received into rx_buffers while earlier ones are written, so the UART
+ * is drained also while the SD card is busy. Preallocated files are written without
+ * cluster allocations, other files only while nothing is in flight, so that no byte
+ * is dropped while the SD card is busy for longer than the UART ring lasts.
+ */
+void Network::pollDownloadReceive()
+{
+    // Receive whatever has arrived, never into the buffer still being saved
+    if (drainChunks(min(this->chunks, this->committed + NETWORK_RX_BUFFERS)))
+    {
+        stateProgressed();
+    }
+
+    // Throw away chunks still in flight after a bad one and resume once the line is quiet
+    if (this->resyncing)
+    {
+        while (NETWORK_SERIAL.available() > 0)
+        {
+            NETWORK_SERIAL.read();
+            this->resync_started = millis();
+        }
+        if (this->committed == this->rx_received && millis() - this->resync_started >= NETWORK_RESYNC_MS)
+        {
+            sendResume();
+        }
+    }
+
+    // Send 'READY' message to remote node for every chunk there is a free buffer for
+    while (!this->resyncing &&
+           this->requested < this->chunks &&
+           this->requested < this->rx_received + this->window &&
+           this->requested < this->committed + NETWORK_RX_BUFFERS)
+    {
+        NETWORK_SERIAL.write(READY);
+        this->requested++;
+        stampCredited(this->requested - 1);
+    }
+
+    // Files growing as they are written may stall for a cluster allocation longer than the
+    // UART ring lasts, so they are only written while no credited bytes can arrive
+    bool const deferred = !Storage::instance().fileIsPreallocated() && !this->resyncing &&
+                          (this->requested > this->rx_received || this->rx_position > 0);
+    if (this->committed == this->rx_received || deferred)
+    {
+        // Nothing to save yet, the remote node might have missed the last 'READY'
+        if (this->committed == this->chunks)
+        {
+            finishTransfer();
+        }
+        else if (stateExpired() && this->state == NetworkState::download_receive)
+        {
+            // Framed transfers recover from any stall, unframed ones only between chunks
+            if (this->framed && !this->resyncing)
+            {
+                beginResync();
+            }
+            else if (!this->framed && this->rx_position == 0)
+            {
+                NETWORK_SERIAL.write(READY);
+            }
+        }
+        return;
+    }
+
+    // Save the oldest received chunk to the SD card
+    // Chunks of a whole sector go straight to the card, others are saved in slices through the
+    // sector cache of Storage, which gathers the chunks of older nodes into whole sectors
+    uint32_t const i = this->committed * this->chunk_size;
+    uint16_t const chunk_length = min(this->transfer_size - i, (uint32_t)this->chunk_size);
+    uint8_t * const chunk = this->rx_buffers[this->committed % NETWORK_RX_BUFFERS];
+    int32_t written;
+    uint16_t amount;
+    if (chunk_length == STORAGE_SECTOR_SIZE)
+    {
+        STAT_TIME_START(write_started);
+        amount = chunk_length;
+        written = Storage::instance().fileWriteSectors(chunk, 1);
+        STAT_TIME(stat_sector_write, write_started);
+    }
+    else
+    {
+        amount = min(chunk_length - this->commit_position, NETWORK_COMMIT_SLICE);
+        written = Storage::instance().fileWriteData(chunk + this->commit_position, amount);
+    }
+    if (written != amount)
+    {
+        Serial.println("Failed to save the received chunk!");
+        Serial.println("Aborting download procedure!");
+        abortTransfer();
+        return;
+    }
+    this->commit_position += amount;
+
+    if (this->commit_position == chunk_length)
+    {
+        // Buffer is free again
+        this->committed++;
+        this->commit_position = 0;
+        this->transferred = i + chunk_length;
+        if (this->committed == this->chunks)
+        {
+            finishTransfer();
+        }
+    }
+}
+
+/**
+ * @brief      Starts uploading a file to currently connected node, see Network::poll
+ *
+ * See Network::startDownload for the window negotiation and encoded transfers.
+ *
+ * @param      filepath The filename/path of the file
+ * @param      push 1 = push upload file to remote node, 0 = upload file to remote node upon receiving download request
+ * @param      encoded 1 = upload the encoded version of the bitmap, encoding it first if needed
+ *
+ * @return     True if the upload was started, False if another transfer is running or the file could not be opened
+ */
+bool Network::startUpload(char filepath[], bool push, bool encoded)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+    // Send the encoded version instead of the bitmap
+    char filepath_encoded[50];
+    char *filepath_send = filepath;
+    if (encoded)
+    {
+        // getBitmap encodes the bitmap if it is already not done
+        Storage::instance().getBitmap(filepath, 0, 0);
+        Storage::instance().getEncodedPath(filepath, filepath_encoded);
+        filepath_send = filepath_encoded;
+    }
+
+    // Open the file and get size
+    if (!Storage::instance().fileOpenToRead(filepath_send))
+    {
+        Serial.println("Failed to open file for uploading!");
+        Serial.println("Aborting upload procedure!");
+        this->state = NetworkState::network_failed;
+        return false;
+    }
+    this->transfer_size = Storage::instance().fileSize();
+    this->transferred = 0;
+    this->framed = false;
+    this->chunk_size = NETWORK_CHUNK_SIZE;
+
+    // Tag the file with a CRC of its size, first and last chunk, which tells versions
+    // of the file apart without reading all of it
+    uint8_t * const buffer = this->rx_buffers[0];
+    uint8_t const size_bytes[4] = { (uint8_t)this->transfer_size, (uint8_t)(this->transfer_size >> 8),
+                                    (uint8_t)(this->transfer_size >> 16), (uint8_t)(this->transfer_size >> 24) };
+    this->transfer_tag = crc16(size_bytes, 4);
+    int32_t length = Storage::instance().fileReadData(buffer, NETWORK_CHUNK_SIZE);
+    this->transfer_tag = crc16(buffer, max(length, (int32_t)0), this->transfer_tag);
+    if (this->transfer_size > NETWORK_CHUNK_SIZE)
+    {
+        Storage::instance().fileSeek((this->transfer_size - 1) / NETWORK_CHUNK_SIZE * NETWORK_CHUNK_SIZE);
+        length = Storage::instance().fileReadData(buffer, NETWORK_CHUNK_SIZE);
+        this->transfer_tag = crc16(buffer, max(length, (int32_t)0), this->transfer_tag);
+    }
+    Storage::instance().fileSeek(0);
+
+    // Send upload command to node with the file size so that it knows how many bytes to save
+    if (push) { //if file is to be pushed, also send filepath first
+        sendFrame(encoded ? UPLOAD_ENCODED : UPLOAD_FILE, 0, strlen(filepath));
+        NETWORK_SERIAL.print(filepath);
+    }
+
+    Serial.print("Waiting for 'READY'\n");
+    enterState(NetworkState::upload_wait_ready, NETWORK_TIMEOUT_MS);
+    return true;
+}
+
+/**
+ * @brief      Waits for the remote node to respond with 'READY'
+ */
+void Network::pollUploadReady()
+{
+    if (NETWORK_SERIAL.available() <= 0)
+    {
+        stateExpired();
+        return;
+    }
+
+    uint8_t const msg = NETWORK_SERIAL.read();
+    Serial.print("Message received: ");
+    Serial.println(msg);
+
+    if (msg != READY)
+    {
+        Serial.println("Remote node did not respond with 'READY'!");
+        Serial.println("Aborting upload procedure!");
+        abortTransfer();
+        return;
+    }
+    enterState(NetworkState::upload_negotiate, NETWORK_NEGOTIATE_MS);
+}
+
+/**
+ * @brief      Checks whether the remote node asks for a windowed transfer and sends the file size
+ */
+void Network::pollUploadNegotiate()
+{
+    uint32_t const size_of_file = this->transfer_size;
+    // Bytes keep arriving meanwhile, so decide on what had arrived when first looked at
+    int const available = NETWORK_SERIAL.available();
+    bool const windowed = available > 0 && NETWORK_SERIAL.peek() == READY_WINDOWED;
+    if (available < (windowed ? 2 : 1) && millis() - this->state_started < this->state_timeout)
+    {
+        return;
+    }
+
+    this->credits = 0;
+    if (windowed && available >= 2)
+    {
+        uint8_t request[2];
+        _readBytes(request, 2);
+        this->credits = max(min(request[1] & NETWORK_WINDOW_MASK, this->window_size), 1);
+        this->window = this->credits;
+        this->framed = (request[1] & NETWORK_FLAG_FRAMED) != 0;
+        uint8_t const flags = 0x80 | (this->framed ? NETWORK_FLAG_FRAMED : 0) | this->credits;
+        uint8_t const tag[2] = { (uint8_t)this->transfer_tag, (uint8_t)(this->transfer_tag >> 8) };
+        if (request[1] & NETWORK_FLAG_HEADER)
+        {
+            sendFrame(WINDOW_ACK, flags, size_of_file);
+        }
+        else
+        {
+            // Receivers predating NetworkFrame
+            uint8_t const header[6] = { WINDOW_ACK, flags,
+                                        (uint8_t)size_of_file, (uint8_t)(size_of_file >> 8),
+                                        (uint8_t)(size_of_file >> 16), (uint8_t)(size_of_file >> 24) };
+            NETWORK_SERIAL.write(header, 6);
+        }
+        if (this->framed)
+        {
+            NETWORK_SERIAL.write(tag, 2);
+        }
+    }
+    else
+    {
+        // Receivers predating the window request take chunks of the old size
+        NETWORK_SERIAL.print(size_of_file);
+        this->chunk_size = NETWORK_LEGACY_CHUNK_SIZE;
+    }
+    Serial.print("Size of file being sent is: ");
+    Serial.println(size_of_file);
+
+    if (this->framed)
+    {
+        // Remote node tells where to start from, its partial download might be resumed
+        this->credits = 0;
+        this->resume_seen = false;
+        enterState(NetworkState::upload_wait_resume, NETWORK_TIMEOUT_MS);
+        return;
+    }
+    this->send_position = this->chunk_size;
+    enterState(NetworkState::upload_send, NETWORK_TIMEOUT_MS);
+}
+
+/**
+ * @brief      Waits for the remote node to tell where to continue a framed transfer from
+ */
+void Network::pollUploadResume()
+{
+    // Anything before 'READY_RESUME' was meant for chunks that are thrown away
+    while (!this->resume_seen && NETWORK_SERIAL.available() > 0)
+    {
+        this->resume_seen = NETWORK_SERIAL.read() == READY_RESUME;
+    }
+    if (!this->resume_seen || NETWORK_SERIAL.available() < 4)
+    {
+        stateExpired();
+        return;
+    }
+
+    uint8_t message[4];
+    _readBytes(message, 4);
+    this->resume_seen = false;
+    uint32_t const offset =
+        ((uint32_t)message[0]) +
+        ((uint32_t)message[1] << 8) +
+        ((uint32_t)message[2] << 16) +
+        ((uint32_t)message[3] << 24);
+
+    // Remote node confirms that it has saved everything
+    if (offset >= this->transfer_size)
+    {
+        this->transferred = this->transfer_size;
+        finishTransfer();
+        return;
+    }
+
+    this->transferred = offset - offset % NETWORK_CHUNK_SIZE;
+    Storage::instance().fileSeek(this->transferred);
+    this->credits = this->window;
+    this->send_position = NETWORK_FRAME_SIZE;
+    enterState(NetworkState::upload_send, NETWORK_TIMEOUT_MS);
+}
+
+/**
+ * @brief      Sends as much of the current chunk as fits into the transmit buffer
+ */
+void Network::pollUploadSend()
+{
+    // Nothing is being received meanwhile, so borrow a receive buffer
+    uint8_t * const buffer = this->rx_buffers[0];
+    uint16_t const frame_size = this->framed ? NETWORK_FRAME_SIZE : this->chunk_size;
+    uint16_t const data_start = this->framed ? 2 : 0;
+
+    // Collect 'READY' messages from remote node
+    while (NETWORK_SERIAL.available() > 0)
+    {
+        uint8_t const msg = NETWORK_SERIAL.read();
+        if (msg == READY)
+        {
+            this->credits++;
+            stateProgressed();
+        }
+        else if (this->framed && (msg == CHUNK_NAK || msg == READY_RESUME))
+        {
+            // Remote node throws away the chunks in flight, stop until it tells where to continue from
+            this->resume_seen = msg == READY_RESUME;
+            enterState(NetworkState::upload_wait_resume, NETWORK_TIMEOUT_MS);
+            return;
+        }
+    }
+
+    if (this->send_position == frame_size)
+    {
+        if (this->transferred >= this->transfer_size)
+        {
+            // Framed transfers are done once the remote node confirms it
+            if (!this->framed)
+            {
+                finishTransfer();
+            }
+            else
+            {
+                stateExpired();
+            }
+            return;
+        }
+        // Wait for 'READY' message from remote node if the window is used up
+        if (this->credits == 0)
+        {
+            stateExpired();
+            return;
+        }
+
+        // Read a chunk from Storage, the last one might be short
+        if (Storage::instance().fileReadData(buffer, this->chunk_size) <= 0)
+        {
+            Serial.println("Failed to read the file being uploaded!");
+            Serial.println("Aborting upload procedure!");
+            abortTransfer();
+            return;
+        }
+        this->credits--;
+        this->send_position = 0;
+        if (this->framed)
+        {
+            uint16_t const sequence = this->transferred / NETWORK_CHUNK_SIZE;
+            this->frame_fields[0] = (uint8_t)sequence;
+            this->frame_fields[1] = (uint8_t)(sequence >> 8);
+            uint16_t const crc = crc16(buffer, NETWORK_CHUNK_SIZE, crc16(this->frame_fields, 2));
+            this->frame_fields[2] = (uint8_t)crc;
+            this->frame_fields[3] = (uint8_t)(crc >> 8);
+        }
+    }
+
+    // Send the chunk without waiting for the transmit buffer
+    int const room = NETWORK_SERIAL.availableForWrite();
+    uint16_t budget = max(room, 1);
+    while (budget > 0 && this->send_position < frame_size)
+    {
+        uint8_t const *data;
+        uint16_t length;
+        if (this->send_position < data_start)
+        {
+            data = this->frame_fields + this->send_position;
+            length = data_start - this->send_position;
+        }
+        else if (this->send_position < data_start + this->chunk_size)
+        {
+            data = buffer + this->send_position - data_start;
+            length = data_start + this->chunk_size - this->send_position;
+        }
+        else
+        {
+            data = this->frame_fields + this->send_position - this->chunk_size;
+            length = frame_size - this->send_position;
+        }
+        uint16_t const amount = min(length, budget);
+        NETWORK_SERIAL.write(data, amount);
+        STAT_COUNT(stat_net_tx_bytes, amount);
+        this->send_position += amount;
+        budget -= amount;
+    }
+    stateProgressed();
+    if (this->send_position == frame_size)
+    {
+        this->transferred = min(this->transferred + this->chunk_size, this->transfer_size);
+    }
+}
+
+/**
+ * @brief      Completes the running transfer
+ */
+void Network::finishTransfer()
+{
+    if (this->state == NetworkState::download_receive)
+    {
+        // Confirm to a framed sender that everything was saved
+        if (this->framed)
+        {
+            sendResume();
+        }
+
+        // Replace the file only now that it is complete
+        char part_path[sizeof(this->transfer_path) + 10];
+        getPartPath(part_path);
+        Storage::instance().fileClose();
+        if (!Storage::instance().fileRename(part_path, this->transfer_path))
+        {
+            Serial.println("Failed to replace the downloaded file!");
+            this->state = NetworkState::network_failed;
+            return;
+        }
+        Serial.print("Download completed successfully...\n");
+    }
+
+    // Finally close the file handle
+    Storage::instance().fileClose();
+    this->state = NetworkState::network_done;
+}
+
+/**
+ * @brief      Aborts the running transfer, leaving the .part file of a download behind
+ */
+void Network::abortTransfer()
+{
+    if (isBusy())
+    {
+        Storage::instance().fileClose();
+    }
+    this->state = NetworkState::network_failed;
+}
+
+/**
+ * @brief      Advances the running transfer without blocking, to be called from the main loop
+ *
+ * Every call does a bounded amount of work: draining Serial1, sending as much as
+ * fits into the transmit buffer and saving at most one sector. Each state has a
+ * deadline, after which the last message is repeated where that is safe, until
+ * NETWORK_RETRIES retries have been used up.
+ *
+ * @return     State of the transfer after this step
+ */
+NetworkState Network::poll()
+{
+    switch (this->state)
+    {
+    case NetworkState::download_wait_size:
+        pollDownloadSize();
+        break;
+    case NetworkState::download_receive:
+        pollDownloadReceive();
+        break;
+    case NetworkState::upload_wait_ready:
+        pollUploadReady();
+        break;
+    case NetworkState::upload_negotiate:
+        pollUploadNegotiate();
+        break;
+    case NetworkState::upload_wait_resume:
+        pollUploadResume();
+        break;
+    case NetworkState::upload_send:
+        pollUploadSend();
+        break;
+    default:
+        break;
+    }
+    return this->state;
+}
+
+/**
+ * @brief      Checks whether a transfer is running
+ *
+ * @return     True if a transfer is running, False otherwise
+ */
+bool Network::isBusy()
+{
+    return this->state != NetworkState::network_idle &&
+           this->state != NetworkState::network_done &&
+           this->state != NetworkState::network_failed;
+}
+
+/**
+ * @brief      Returns the amount of bytes of the running or last transfer that have been completed
+ *
+ * @return     Amount of bytes saved or sent
+ */
+uint32_t Network::getTransferred()
+{
+    return this->transferred;
+}
+
+/**
+ * @brief      Returns the size of the running or last transfer
+ *
+ * @return     Size of the file in bytes, 0 if not yet known
+ */
+uint32_t Network::getTransferSize()
+{
+    return this->transfer_size;
+}
+
+/**
+ * @brief      Sends the files that differ on currently connected node in one session, blocking until done
+ *
+ * Sends a NetworkFrame of SYNC_FILES, the amount of files and a manifest with the NUL terminated path,
+ * 32-bit little-endian size and 16-bit little-endian CRC16 of each file, see
+ * Storage::getFileHash. The remote node
+ * compares it with its own files in Network::receiveSync and answers with SYNC_FILES
+ * and a bitmask of the files it wants, lowest bit first. Each wanted file is then sent
+ * back to back as its NUL terminated path followed by a normal transfer, see
+ * Network::startDownload.
+ *
+ * @param      filepaths  Filenames/paths of the files
+ * @param      count      Amount of files
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::syncFiles(char *filepaths[], uint8_t count)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+    // Check every file up front so that a missing one doesn't leave the manifest half sent
+    uint32_t length = 1;
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        if (!Storage::instance().fileOpenToRead(filepaths[i]))
+        {
+            Serial.print("Failed to open file for syncing: ");
+            Serial.println(filepaths[i]);
+            return false;
+        }
+        length += strlen(filepaths[i]) + 1 + 6;
+    }
+    Storage::instance().fileClose();
+
+    // Send the manifest
+    Serial.print("Sending manifest...\n");
+    sendFrame(SYNC_FILES, 0, length);
+    NETWORK_SERIAL.write(count);
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        uint16_t const hash = Storage::instance().getFileHash(filepaths[i]);
+        uint32_t const size = Storage::instance().fileSize();
+        uint8_t const entry[6] = { (uint8_t)size, (uint8_t)(size >> 8), (uint8_t)(size >> 16),
+                                   (uint8_t)(size >> 24), (uint8_t)hash, (uint8_t)(hash >> 8) };
+        NETWORK_SERIAL.print(filepaths[i]);
+        NETWORK_SERIAL.write((uint8_t)'\0');
+        NETWORK_SERIAL.write(entry, 6);
+    }
+    Storage::instance().fileClose();
+
+    // Remote node answers with the files it wants
+    uint8_t const mask_size = (count + 7) / 8;
+    if (!_waitForBytes(1 + mask_size, NETWORK_SYNC_TIMEOUT_MS) || NETWORK_SERIAL.read() != SYNC_FILES)
+    {
+        Serial.println("Remote node did not answer the manifest!");
+        return false;
+    }
+    uint8_t wanted[32];
+    _readBytes(wanted, mask_size);
+
+    uint8_t sent = 0;
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        if (!(wanted[i / 8] & (1 << (i % 8))))
+        {
+            continue;
+        }
+        NETWORK_SERIAL.print(filepaths[i]);
+        NETWORK_SERIAL.write((uint8_t)'\0');
+        if (!uploadFile(filepaths[i], false))
+        {
+            return false;
+        }
+        sent++;
+    }
+    Serial.print("Synced files: ");
+    Serial.println(sent);
+    return true;
+}
+
+/**
+ * @brief      Receives the files that differ from currently connected node, blocking until done
+ *
+ * To be called after SYNC_FILES has been received with Network::receiveCommand,
+ * see Network::syncFiles.
+ * The manifest is kept in the chunk buffers until every file has been compared, so
+ * that nothing is lost from Serial1 while files are being hashed. Files that don't fit
+ * there are always requested.
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::receiveSync()
+{
+    if (isBusy() || !_waitForBytes(1))
+    {
+        return false;
+    }
+
+    // Nothing is being transferred meanwhile, so keep the manifest in the receive buffers
+    uint8_t const count = NETWORK_SERIAL.read();
+    uint8_t * const manifest = this->rx_buffers[0];
+    uint16_t const capacity = sizeof(this->rx_buffers);
+    uint16_t length = 0;
+    uint8_t wanted[32] = { 0 };
+    char filepath[sizeof(this->transfer_path)];
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        uint8_t entry[6];
+        if (!_readString(filepath, sizeof(filepath)) || !_waitForBytes(6))
+        {
+            return false;
+        }
+        _readBytes(entry, 6);
+
+        uint16_t const entry_length = strlen(filepath) + 1 + 6;
+        if (length + entry_length > capacity)
+        {
+            wanted[i / 8] |= 1 << (i % 8);
+            continue;
+        }
+        strcpy((char *)manifest + length, filepath);
+        memcpy(manifest + length + entry_length - 6, entry, 6);
+        length += entry_length;
+    }
+
+    // Compare the manifest with the files saved here
+    uint16_t position = 0;
+    for (uint8_t i = 0; i < count && position < length; ++i)
+    {
+        if (wanted[i / 8] & (1 << (i % 8)))
+        {
+            continue;
+        }
+        char * const name = (char *)manifest + position;
+        uint8_t const * const entry = manifest + position + strlen(name) + 1;
+        position += strlen(name) + 1 + 6;
+
+        uint32_t const size =
+            ((uint32_t)entry[0]) +
+            ((uint32_t)entry[1] << 8) +
+            ((uint32_t)entry[2] << 16) +
+            ((uint32_t)entry[3] << 24);
+        uint16_t const hash = entry[4] | ((uint16_t)entry[5] << 8);
+        bool const same = Storage::instance().getFileHash(name) == hash &&
+                          Storage::instance().fileSize() == size;
+        if (!same)
+        {
+            wanted[i / 8] |= 1 << (i % 8);
+        }
+    }
+    Storage::instance().fileClose();
+
+    uint8_t const mask_size = (count + 7) / 8;
+    NETWORK_SERIAL.write(SYNC_FILES);
+    NETWORK_SERIAL.write(wanted, mask_size);
+
+    // Receive the wanted files back to back
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        if (!(wanted[i / 8] & (1 << (i % 8))))
+        {
+            continue;
+        }
+        if (!_readString(filepath, sizeof(filepath)) || !downloadFile(filepath, true))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief      Sends the mappings that differ on currently connected node, blocking until done
+ *
+ * Sends a NetworkFrame of SYNC_MAPPING, to which the remote node answers with SYNC_MAPPING, its 16-bit
+ * little-endian amount of mappings and a 16-bit little-endian hash of each, see
+ * Storage::getMappingHash. Mappings whose hash differs are then sent as a 16-bit
+ * little-endian amount followed by one NUL terminated line per mapping, in the text
+ * format of Storage::importMappingList. The remote node applies them in
+ * Network::receiveMappingSync and answers with SYNC_MAPPING and 0. If the lists don't
+ * have the same floors, the amount is sent as 0xFFFF or the remote node answers with 1,
+ * and the whole mapping file is sent instead.
+ *
+ * @param      mapFileName  Name of the file holding the mapping loaded into Storage
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::syncMapping(char mapFileName[])
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+    sendFrame(SYNC_MAPPING, 0, 0);
+    if (!_waitForBytes(3) || NETWORK_SERIAL.read() != SYNC_MAPPING)
+    {
+        Serial.println("Remote node did not answer the mapping sync!");
+        return false;
+    }
+    uint8_t count_bytes[2];
+    _readBytes(count_bytes, 2);
+    uint16_t const remote_floors = count_bytes[0] | ((uint16_t)count_bytes[1] << 8);
+
+    // Keep the remote hashes in the receive buffers, so nothing is lost while comparing
+    MappingList const &mappinglist = Storage::instance().getMappingList();
+    uint16_t * const hashes = (uint16_t *)this->rx_buffers[0];
+    bool const same_floors = remote_floors == mappinglist.n_floors &&
+                             remote_floors <= sizeof(this->rx_buffers) / sizeof(uint16_t);
+    for (uint16_t i = 0; i < remote_floors; ++i)
+    {
+        uint8_t hash[2];
+        if (!_waitForBytes(2))
+        {
+            return false;
+        }
+        _readBytes(hash, 2);
+        if (same_floors)
+        {
+            hashes[i] = hash[0] | ((uint16_t)hash[1] << 8);
+        }
+    }
+
+    bool full = !same_floors;
+    if (same_floors)
+    {
+        uint16_t changed = 0;
+        for (uint16_t i = 0; i < remote_floors; ++i)
+        {
+            hashes[i] = hashes[i] != Storage::instance().getMappingHash(i);
+            changed += hashes[i];
+        }
+        NETWORK_SERIAL.write((uint8_t)changed);
+        NETWORK_SERIAL.write((uint8_t)(changed >> 8));
+
+        for (uint16_t i = 0; i < remote_floors; ++i)
+        {
+            if (!hashes[i])
+            {
+                continue;
+            }
+            Mapping const &mapping = mappinglist.map_list[i];
+            NETWORK_SERIAL.print(Storage::instance().getMappingName(mapping.floorNo));
+            NETWORK_SERIAL.write((uint8_t)',');
+            NETWORK_SERIAL.print(Storage::instance().getMappingName(mapping.bitmapName));
+            NETWORK_SERIAL.write((uint8_t)',');
+            NETWORK_SERIAL.print(Storage::instance().getMappingName(mapping.bitmapName2));
+            NETWORK_SERIAL.write((uint8_t)'\0');
+        }
+        Serial.print("Changed mappings: ");
+        Serial.println(changed);
+
+        if (!_waitForBytes(2, NETWORK_SYNC_TIMEOUT_MS) || NETWORK_SERIAL.read() != SYNC_MAPPING)
+        {
+            Serial.println("Remote node did not apply the mappings!");
+            return false;
+        }
+        full = NETWORK_SERIAL.read() != 0;
+    }
+    else
+    {
+        NETWORK_SERIAL.write((uint8_t)0xFF);
+        NETWORK_SERIAL.write((uint8_t)0xFF);
+    }
+
+    // Floors differ, send the whole mapping as it is in memory
+    if (full)
+    {
+        Serial.println("Sending the whole mapping...");
+        return Storage::instance().commitMappingList(mapFileName) == 0 && uploadFile(mapFileName, false);
+    }
+    return true;
+}
+
+/**
+ * @brief      Receives the mappings that differ from currently connected node, blocking until done
+ *
+ * To be called after SYNC_MAPPING has been received with Network::receiveCommand,
+ * see Network::syncMapping.
+ * Changed mappings are applied with Storage::setFloorMapping and saved with
+ * Storage::commitMappingList.
+ *
+ * @param      mapFileName  Name of the file holding the mapping
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::receiveMappingSync(char mapFileName[])
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+    MappingList const &mappinglist = Storage::instance().getMappingList(mapFileName);
+    uint8_t const header[3] = { SYNC_MAPPING, (uint8_t)mappinglist.n_floors, (uint8_t)(mappinglist.n_floors >> 8) };
+    NETWORK_SERIAL.write(header, 3);
+    for (uint16_t i = 0; i < mappinglist.n_floors; ++i)
+    {
+        uint16_t const hash = Storage::instance().getMappingHash(i);
+        NETWORK_SERIAL.write((uint8_t)hash);
+        NETWORK_SERIAL.write((uint8_t)(hash >> 8));
+    }
+
+    uint8_t count_bytes[2];
+    if (!_waitForBytes(2, NETWORK_SYNC_TIMEOUT_MS))
+    {
+        return false;
+    }
+    _readBytes(count_bytes, 2);
+    uint16_t const changed = count_bytes[0] | ((uint16_t)count_bytes[1] << 8);
+
+    // Apply every line even after a failure to stay in step with the remote node
+    bool applied = changed != 0xFFFF;
+    uint16_t const lines = applied ? changed : 0;
+    for (uint16_t i = 0; i < lines; ++i)
+    {
+        char line[STORAGE_MAPPING_LINE];
+        if (!_readString(line, sizeof(line)))
+        {
+            return false;
+        }
+        char *bmp_name = strchr(line, ',');
+        char *bmp_name2 = bmp_name ? strchr(bmp_name + 1, ',') : nullptr;
+        if (!bmp_name || !bmp_name2)
+        {
+            applied = false;
+            continue;
+        }
+        *bmp_name++ = '\0';
+        *bmp_name2++ = '\0';
+        applied = Storage::instance().setFloorMapping(line, bmp_name, bmp_name2) == 0 && applied;
+    }
+
+    if (changed != 0xFFFF)
+    {
+        applied = applied && (changed == 0 || Storage::instance().commitMappingList(mapFileName) == 0);
+        NETWORK_SERIAL.write(SYNC_MAPPING);
+        NETWORK_SERIAL.write((uint8_t)(applied ? 0 : 1));
+    }
+    if (applied)
+    {
+        return true;
+    }
+
+    // Floors differ, receive the whole mapping instead
+    if (!downloadFile(mapFileName, true))
+    {
+        return false;
+    }
+    Storage::instance().getMappingList(mapFileName);
+    return true;
+}
+
+/**
+ * @brief      Sends the instrumentation counters and timers to currently connected node
+ *
+ * To be called after GET_STATS has been received with Network::receiveCommand, resetting
+ * if its flags hold STATS_FLAG_RESET. Answers with a NetworkFrame of GET_STATS, followed
+ * by the amount of counters and timers as one byte each, every counter and then the
+ * count, total and longest microseconds of every timer, all 32-bit little-endian.
+ * Nothing follows the frame if instrumentation is compiled out.
+ *
+ * @param      reset  1 = reset the statistics once sent
+ *
+ * @return     True on success, False if a transfer is running
+ */
+bool Network::sendStats(bool reset)
+{
+    if (isBusy())
+    {
+        return false;
+    }
+
+#if STATS_ENABLED
+    sendFrame(GET_STATS, 0, 2 + 4 * (stat_counter_count + 3 * stat_timer_count));
+    NETWORK_SERIAL.write((uint8_t)stat_counter_count);
+    NETWORK_SERIAL.write((uint8_t)stat_timer_count);
+    for (uint8_t i = 0; i < stat_counter_count; ++i)
+    {
+        uint32_t const value = statGetCount((StatCounter)i);
+        NETWORK_SERIAL.write((uint8_t const *)&value, 4);
+    }
+    for (uint8_t i = 0; i < stat_timer_count; ++i)
+    {
+        StatTiming const &timing = statGetTiming((StatTimer)i);
+        NETWORK_SERIAL.write((uint8_t const *)&timing, sizeof(timing));
+    }
+    if (reset)
+    {
+        statReset();
+    }
+#else
+    sendFrame(GET_STATS, 0, 0);
+#endif
+    return true;
+}
+
+/**
+ * @brief      Reads a command of currently connected node, blocking until it has arrived
+ *
+ * Commands of older nodes are a single byte followed by the filepath, which ends
+ * when no more characters arrive within NETWORK_NEGOTIATE_MS. The filepath of file
+ * commands is read from either, any other payload is left for the command to read.
+ *
+ * @param      frame     Frame of the command will be stored here, with length 0 for older nodes
+ * @param      filepath  Filepath of a file command will be stored here
+ * @param      size      Size of filepath
+ *
+ * @return     True if a command was received, False on timeout or a corrupted frame
+ */
+bool Network::receiveCommand(NetworkFrame &frame, char filepath[], uint16_t size)
+{
+    filepath[0] = '\0';
+    if (!_waitForBytes(1))
+    {
+        return false;
+    }
+
+    bool const legacy = NETWORK_SERIAL.peek() != NETWORK_MAGIC_0;
+    if (legacy)
+    {
+        memset(&frame, 0, sizeof(frame));
+        frame.command = NETWORK_SERIAL.read();
+    }
+    else if (!_waitForBytes(sizeof(frame)))
+    {
+        return false;
+    }
+    else
+    {
+        _readBytes((uint8_t *)&frame, sizeof(frame));
+        if (frame.magic[1] != NETWORK_MAGIC_1)
+        {
+            Serial.println("Received a corrupted command!");
+            return false;
+        }
+    }
+
+    if (frame.command < DOWNLOAD_FILE || frame.command > UPLOAD_ENCODED)
+    {
+        return true;
+    }
+
+    // Read the filepath, cutting it to the buffer
+    uint16_t length = 0;
+    uint32_t last_received = millis();
+    while (legacy ? millis() - last_received < NETWORK_NEGOTIATE_MS : length < frame.length)
+    {
+        if (NETWORK_SERIAL.available() <= 0)
+        {
+            if (!legacy && millis() - last_received >= NETWORK_TIMEOUT_MS)
+            {
+                Serial.println("Remote node timed out!");
+                return false;
+            }
+            continue;
+        }
+        char const c = NETWORK_SERIAL.read();
+        if (length + 1 < size)
+        {
+            filepath[length] = c;
+        }
+        length++;
+        last_received = millis();
+    }
+    filepath[min(length, (uint16_t)(size - 1))] = '\0';
+    return true;
+}
+
+/**
+ * @brief      Download file from currently connected node, blocking until done
+ *
+ * See Network::startDownload.
+ *
+ * @param      filepath The filename/path of the file
+ * @param      push 1 = download pushed file from remote node, 0 = download normal file after requesting it from remote node
+ * @param      encoded 1 = download the encoded version of the bitmap
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::downloadFile(char filepath[], bool push, bool encoded)
+{
+    if (!startDownload(filepath, push, encoded))
+    {
+        return false;
+    }
+    while (isBusy())
+    {
+        poll();
+    }
+    return this->state == NetworkState::network_done;
+}
+
+/**
+ * @brief      Upload file to currently connected node, blocking until done
+ *
+ * See Network::startUpload.
+ *
+ * @param      filepath The filename/path of the file
+ * @param      push 1 = push upload file to remote node, 0 = upload file to remote node upon receiving download request
+ * @param      encoded 1 = upload the encoded version of the bitmap, encoding it first if needed
+ *
+ * @return     True on success, False otherwise
+ */
+bool Network::uploadFile(char filepath[], bool push, bool encoded)
+{
+    if (!startUpload(filepath, push, encoded))
+    {
+        return false;
+    }
+    while (isBusy())
+    {
+        poll();
+    }
+    return this->state == NetworkState::network_done;
+}
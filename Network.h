@@ -5,10 +5,107 @@
 #include <string.h>
 #include <stdint.h>
 #include "Storage.h"
+#include "Stats.h"
 
 #define DOWNLOAD_FILE 2
 #define UPLOAD_FILE 3
+// Same as above but the encoded .cbm version of a bitmap is transferred
+#define DOWNLOAD_ENCODED 4
+#define UPLOAD_ENCODED 5
+// Batch transfer of the files that differ between two nodes, see Network::syncFiles
+#define SYNC_FILES 6
+// Transfer of the floor mappings that differ between two nodes, see Network::syncMapping
+#define SYNC_MAPPING 12
+// Request for the instrumentation counters and timers, see Network::sendStats
+#define GET_STATS 13
+// Flag of GET_STATS asking to reset the statistics once sent
+#define STATS_FLAG_RESET 0x01
 #define READY 7
+// Windowed transfer negotiation, see Network::downloadFile
+#define READY_WINDOWED 8
+#define WINDOW_ACK 9
+// Framed transfer recovery, see Network::startDownload
+#define READY_RESUME 10
+#define CHUNK_NAK 11
+
+// Serial port the HC-05 is connected to, replaceable to run Network over another port or a mock of one
+#ifndef NETWORK_SERIAL
+#define NETWORK_SERIAL Serial1
+#endif
+
+// Magic bytes starting a NetworkFrame, never sent first by older nodes
+#define NETWORK_MAGIC_0 'B'
+#define NETWORK_MAGIC_1 'T'
+
+// Amount of bytes sent per chunk, one SD card sector so that chunks are written without the sector cache
+#define NETWORK_CHUNK_SIZE STORAGE_SECTOR_SIZE
+// Amount of bytes sent per chunk by and to older nodes, which do not request a window
+#define NETWORK_LEGACY_CHUNK_SIZE 200
+// Amount of chunks a receiver allows in flight by default (1-31)
+#ifndef NETWORK_WINDOW_SIZE
+#define NETWORK_WINDOW_SIZE 2
+#endif
+// Window request flag of a receiver that understands framed chunks
+#define NETWORK_FLAG_FRAMED 0x40
+// Window request flag of a receiver that understands a NetworkFrame in place of WINDOW_ACK
+#define NETWORK_FLAG_HEADER 0x20
+// Bits of the window request holding the window size
+#define NETWORK_WINDOW_MASK 0x1F
+// Framed chunks carry a 16-bit sequence number before and a CRC16 after the data
+#define NETWORK_FRAME_SIZE (NETWORK_CHUNK_SIZE + 4)
+// How long the line has to stay quiet after a bad chunk before the receiver resumes
+#define NETWORK_RESYNC_MS 30
+// Suffix of the temporary file a download is saved to until it is complete
+#define NETWORK_PART_SUFFIX ".part"
+// How long the sender waits for a window request after 'READY'
+#define NETWORK_NEGOTIATE_MS 50
+// Amount of chunk buffers on the receiving side, at least two so that one can be
+// received while another is written to the SD card
+#if NETWORK_WINDOW_SIZE < 2
+#define NETWORK_RX_BUFFERS 2
+#else
+#define NETWORK_RX_BUFFERS NETWORK_WINDOW_SIZE
+#endif
+// Amount of bytes written to the SD card before draining Serial1 again
+#define NETWORK_COMMIT_SLICE 32
+// Highest UART baud rate tried between Serial1 and the HC-05
+#ifndef NETWORK_MAX_BAUD
+#define NETWORK_MAX_BAUD 460800
+#endif
+// Amount of AT probes that have to succeed before a baud rate is considered stable
+#define NETWORK_LINK_PROBES 8
+// How long a transfer may go without progress before the last message is repeated
+#ifndef NETWORK_TIMEOUT_MS
+#define NETWORK_TIMEOUT_MS 2000
+#endif
+// Amount of times a transfer may time out in a row before it is aborted
+#define NETWORK_RETRIES 3
+// How long a sync sender waits for the remote node to compare the manifest with its files
+#ifndef NETWORK_SYNC_TIMEOUT_MS
+#define NETWORK_SYNC_TIMEOUT_MS 30000
+#endif
+
+typedef struct s_network_frame
+{
+    // Header of every command and of the file size answering 'READY', all fields little-endian
+    uint8_t magic[2]; // NETWORK_MAGIC_0, NETWORK_MAGIC_1
+    uint8_t command;
+    uint8_t flags; // Command specific, the window flags and size for WINDOW_ACK
+    uint32_t length; // Bytes following the header, or the size of the file for WINDOW_ACK
+} NetworkFrame;
+
+typedef enum e_network_state
+{
+    network_idle = 0,
+    network_done,
+    network_failed,
+    download_wait_size,
+    download_receive,
+    upload_wait_ready,
+    upload_negotiate,
+    upload_wait_resume,
+    upload_send
+} NetworkState;
 
 class Network
 {
@@ -22,11 +119,114 @@ public:
     // Prohibit copying of Display class
     Network(Network const&) = delete;
     void operator=(Network const&) = delete;
-    // File download and upload functions
-    void downloadFile(char filename[], bool push);
-    void uploadFile(char filename[], bool push);
+    // File download and upload functions, blocking until done
+    bool downloadFile(char filename[], bool push, bool encoded=false);
+    bool uploadFile(char filename[], bool push, bool encoded=false);
+    // Non-blocking transfer functions, poll() advances the transfer
+    bool startDownload(char filename[], bool push, bool encoded=false);
+    bool startUpload(char filename[], bool push, bool encoded=false);
+    NetworkState poll();
+    bool isBusy();
+    uint32_t getTransferred();
+    uint32_t getTransferSize();
+    // Batch transfer of only the files that differ, blocking until done
+    bool syncFiles(char *filepaths[], uint8_t count);
+    bool receiveSync();
+    bool syncMapping(char mapFileName[]);
+    bool receiveMappingSync(char mapFileName[]);
+    // Sends the instrumentation counters and timers in answer to GET_STATS
+    bool sendStats(bool reset=false);
+    // Reads a command of the remote node, framed or from an older node
+    bool receiveCommand(NetworkFrame &frame, char filepath[], uint16_t size);
+    // Amount of chunks allowed in flight, 1 = stop-and-wait
+    void setWindowSize(uint8_t window_size);
+    // HC-05 link setup functions
+    bool begin();
+    bool configureLink(uint32_t max_baud = NETWORK_MAX_BAUD);
+    bool degradeLink();
+    uint32_t getBaudRate();
 private:
     Network();
+    bool drainChunks(uint32_t chunks);
+    bool frameValid();
+    void getPartPath(char part_path[]);
+    void enterState(NetworkState state, uint32_t timeout);
+    bool stateExpired();
+    void stateProgressed();
+    void sendFrame(uint8_t command, uint8_t flags, uint32_t length);
+    void sendReady();
+    void stampCredited(uint32_t from);
+    void sendResume();
+    void beginResync();
+    bool splitTextSize();
+    void pollDownloadSize();
+    void pollDownloadReceive();
+    void pollUploadReady();
+    void pollUploadNegotiate();
+    void pollUploadResume();
+    void pollUploadSend();
+    void finishTransfer();
+    void abortTransfer();
+    uint32_t detectBaudRate();
+    bool applyBaudRate(uint32_t baud_rate);
+    /** @brief Baud rate currently used between Serial1 and the HC-05, 0 if unknown */
+    uint32_t baud_rate;
+    /** @brief Amount of chunks allowed in flight during windowed transfers */
+    uint8_t window_size;
+    /** @brief Chunk buffers used to receive while earlier chunks are being saved */
+    uint8_t rx_buffers[NETWORK_RX_BUFFERS][NETWORK_CHUNK_SIZE];
+    /** @brief Amount of chunks fully received into rx_buffers */
+    uint32_t rx_received;
+    /** @brief Amount of bytes received of the chunk currently being filled */
+    uint16_t rx_position;
+    /** @brief Sequence number and CRC of the framed chunk being received or sent */
+    uint8_t frame_fields[4];
+    /** @brief Whether chunks are framed, as agreed with the remote node */
+    bool framed;
+    /** @brief Whether a bad chunk is being recovered from by waiting for the line to go quiet */
+    bool resyncing;
+    /** @brief When a byte was last thrown away while resyncing */
+    uint32_t resync_started;
+    /** @brief Whether 'READY_RESUME' has been received and its offset is still to be read */
+    bool resume_seen;
+    /** @brief State of the running transfer */
+    NetworkState state;
+    /** @brief When the current state was entered or last made progress */
+    uint32_t state_started;
+    /** @brief Milliseconds the current state may last without progress */
+    uint32_t state_timeout;
+    /** @brief Amount of times the current state has timed out in a row */
+    uint8_t retries;
+    /** @brief Path the running download is saved to */
+    char transfer_path[50];
+    /** @brief Size of the file being transferred */
+    uint32_t transfer_size;
+    /** @brief Tag telling versions of the file being transferred apart, see Network::startUpload */
+    uint16_t transfer_tag;
+    /** @brief Amount of bytes received after 'READY' from an older node sending the file size as text */
+    uint16_t text_received;
+    /** @brief Amount of bytes saved or sent */
+    uint32_t transferred;
+    /** @brief Amount of bytes of the file per chunk, NETWORK_LEGACY_CHUNK_SIZE with older nodes */
+    uint16_t chunk_size;
+    /** @brief Amount of chunks of the file being downloaded */
+    uint32_t chunks;
+    /** @brief Amount of chunks the remote node has been allowed to send */
+    uint32_t requested;
+    /** @brief Amount of chunks saved to the SD card */
+    uint32_t committed;
+    /** @brief Amount of bytes saved of the chunk being saved */
+    uint16_t commit_position;
+    /** @brief Amount of chunks allowed in flight, as agreed with the remote node */
+    uint8_t window;
+    /** @brief Amount of chunks the remote node is ready to receive */
+    uint8_t credits;
+    /** @brief Amount of bytes sent of the chunk being sent */
+    uint16_t send_position;
+#if STATS_ENABLED
+    /** @brief When each chunk in flight was credited, to measure its latency */
+    uint32_t chunk_credited[NETWORK_RX_BUFFERS];
+#endif
 };
 
 #endif
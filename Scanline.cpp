@@ -0,0 +1,187 @@
+#include "Arduino.h"
+#include "Scanline.h"
+
+#if defined(__AVR__)
+/** @brief Amount of leading zero bits of each byte value */
+static uint8_t const _leading_zeros[256] PROGMEM = {
+    8, 7, 6, 6, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/**
+ * @brief      Finds the first set or clear pixel from a row, one byte at a time
+ *
+ * AVR has no 32-bit count-leading-zeros, so whole bytes are skipped and the
+ * boundary inside a byte is looked up from a table in flash.
+ *
+ * @param      data        Row of pixel data
+ * @param      pixel_state State of the pixel, set/clear (true/false)
+ * @param      index       Index to start searching from
+ * @param      width       Amount of pixels in the row
+ *
+ * @return     Index of the pixel, width if not found
+ */
+uint16_t scanlineFindPixel(uint8_t const data[], bool pixel_state, uint16_t index, uint16_t width)
+{
+    uint8_t const invert = pixel_state ? 0x00 : 0xFF;
+    while (index < width)
+    {
+        uint16_t const position = index / 8;
+        // Ignore the pixels before index
+        uint8_t const bits = (data[position] ^ invert) & (0xFF >> (index % 8));
+        if (bits != 0)
+        {
+            index = position * 8 + pgm_read_byte(&_leading_zeros[bits]);
+            return index < width ? index : width;
+        }
+        index = (position + 1) * 8;
+    }
+    return width;
+}
+#else
+/**
+ * @brief      Finds the first set or clear pixel from a row, 32 pixels at a time
+ *
+ * Words without the requested state are skipped in one step and the boundary
+ * inside a word is located with count-leading-zeros.
+ *
+ * @param      data        Row of pixel data
+ * @param      pixel_state State of the pixel, set/clear (true/false)
+ * @param      index       Index to start searching from
+ * @param      width       Amount of pixels in the row
+ *
+ * @return     Index of the pixel, width if not found
+ */
+uint16_t scanlineFindPixel(uint8_t const data[], bool pixel_state, uint16_t index, uint16_t width)
+{
+    uint32_t const invert = pixel_state ? 0x00000000 : 0xFFFFFFFF;
+    uint16_t const bytes = (width + 7) / 8;
+    while (index < width)
+    {
+        uint16_t const position = index / 8;
+        // Most significant bit first, so the word is assembled big-endian
+        // Bytes past the row are treated as holding no requested pixels
+        uint32_t word = 0;
+        for (uint8_t i = 0; i < 4; ++i)
+        {
+            word <<= 8;
+            word |= (position + i < bytes) ? data[position + i] ^ (uint8_t)invert : 0;
+        }
+        // Ignore the pixels before index
+        word &= 0xFFFFFFFF >> (index % 8);
+        if (word != 0)
+        {
+            index = position * 8 + __builtin_clzl(word) - (sizeof(unsigned long) - 4) * 8;
+            return index < width ? index : width;
+        }
+        index = (position + 4) * 8;
+    }
+    return width;
+}
+#endif
+
+#ifdef SCANLINE_SELFTEST
+/**
+ * @brief      Translate index to pixel memory position
+ *
+ * @param      x     Index to translate
+ *
+ * @return     Index in memory
+ */
+static inline int16_t _translate(uint32_t x)
+{
+    return ((x / 8) * 2 + 1) * 8 - 1 - x;
+}
+
+/**
+ * @brief      Get specific bit state from an array of data. Might overflow!
+ *
+ * @param      data   Data to iterate over
+ * @param      index  Index to retrieve
+ *
+ * @return     State of bit on requested index.
+ */
+static inline bool _bitset(uint8_t const * const data, uint16_t index)
+{
+    return (data[index / 8] & (1 << index % 8)) != 0;
+}
+
+/**
+ * @brief      Finds the first set or clear pixel from a row, as Storage::findPixel did before scanlineFindPixel
+ *
+ * The only change is that the search stops at the end of the row.
+ *
+ * @param      data        Row of pixel data
+ * @param      pixel_state State of the pixel, set/clear (true/false)
+ * @param      index       Index to start searching from
+ * @param      width       Amount of pixels in the row
+ *
+ * @return     Index of the pixel, width if not found
+ */
+static uint16_t _findPixelReference(uint8_t const data[], bool pixel_state, uint16_t index, uint16_t width)
+{
+    while(index < width && _bitset(data, _translate(index)) != pixel_state)
+    {
+        ++index;
+    }
+    return index;
+}
+
+/**
+ * @brief      Compares scanlineFindPixel against the bit-at-a-time implementation it replaced
+ *
+ * Covers every start index and row width up to 96 pixels for sparse, dense and mixed rows.
+ *
+ * @return     True if all results match, False otherwise
+ */
+bool scanlineSelfTest()
+{
+    uint8_t data[12];
+    uint32_t seed = 1;
+    for (uint8_t pattern = 0; pattern < 16; ++pattern)
+    {
+        for (uint8_t i = 0; i < sizeof(data); ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint8_t const noise = seed >> 16;
+            // Alternate between mostly clear, mostly set and random bytes
+            data[i] = (pattern % 3 == 0) ? (noise & (noise >> 3) & 0x11) :
+                      (pattern % 3 == 1) ? (noise | (noise >> 2) | 0xEE) : noise;
+        }
+
+        for (uint16_t width = 1; width <= sizeof(data) * 8; ++width)
+        {
+            for (uint16_t index = 0; index <= width; ++index)
+            {
+                for (uint8_t state = 0; state < 2; ++state)
+                {
+                    if (scanlineFindPixel(data, state, index, width) !=
+                        _findPixelReference(data, state, index, width))
+                    {
+                        Serial.print("Scanline self test failed at width ");
+                        Serial.print(width);
+                        Serial.print(", index ");
+                        Serial.println(index);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+#endif
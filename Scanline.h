@@ -0,0 +1,15 @@
+#ifndef Scanline_h
+#define Scanline_h
+
+#include <stdint.h>
+
+// Run finding on rows of monochrome pixel data, most significant bit first.
+// Shared by the encoder and renderers of raw rows.
+uint16_t scanlineFindPixel(uint8_t const data[], bool pixel_state, uint16_t index, uint16_t width);
+
+#ifdef SCANLINE_SELFTEST
+// Compares scanlineFindPixel bit for bit against the bit-at-a-time implementation it replaced
+bool scanlineSelfTest();
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#include "Stats.h"
+
+#include <string.h>
+
+/** @brief Values of the counters */
+static uint32_t _counters[stat_counter_count];
+/** @brief Durations measured by the timers */
+static StatTiming _timings[stat_timer_count];
+
+/**
+ * @brief      Adds to a counter
+ *
+ * @param      counter  Counter to add to
+ * @param      amount   Amount to add
+ */
+void statCount(StatCounter counter, uint32_t amount)
+{
+    _counters[counter] += amount;
+}
+
+/**
+ * @brief      Records a duration measured by a timer
+ *
+ * micros() has a resolution of 4 microseconds on 16 MHz boards, AVR has no cycle counter.
+ *
+ * @param      timer     Timer that measured the duration
+ * @param      duration  Duration in microseconds
+ */
+void statTime(StatTimer timer, uint32_t duration)
+{
+    StatTiming &timing = _timings[timer];
+    timing.count++;
+    timing.total += duration;
+    if (duration > timing.max)
+    {
+        timing.max = duration;
+    }
+}
+
+/**
+ * @brief      Returns the value of a counter
+ *
+ * @param      counter  Counter to read
+ *
+ * @return     Value of the counter
+ */
+uint32_t statGetCount(StatCounter counter)
+{
+    return _counters[counter];
+}
+
+/**
+ * @brief      Returns the durations measured by a timer
+ *
+ * @param      timer  Timer to read
+ *
+ * @return     Count, total and longest of the durations
+ */
+StatTiming const &statGetTiming(StatTimer timer)
+{
+    return _timings[timer];
+}
+
+/**
+ * @brief      Resets every counter and timer to zero
+ */
+void statReset()
+{
+    memset(_counters, 0, sizeof(_counters));
+    memset(_timings, 0, sizeof(_timings));
+}
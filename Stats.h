@@ -0,0 +1,61 @@
+#ifndef Stats_h
+#define Stats_h
+
+#include <stdint.h>
+
+// Instrumentation of Storage and Network, off unless built with STATS_ENABLED=1 to profile
+#ifndef STATS_ENABLED
+#define STATS_ENABLED 0
+#endif
+
+typedef enum e_stat_counter
+{
+    stat_sd_seeks = 0,
+    stat_sd_reads,
+    stat_sd_read_bytes,
+    stat_sd_writes,
+    stat_sd_write_bytes,
+    stat_net_rx_bytes,
+    stat_net_tx_bytes,
+    stat_net_chunks,
+    stat_net_retries,
+    stat_net_naks,
+    stat_cache_hits,
+    stat_cache_misses,
+    stat_counter_count
+} StatCounter;
+
+typedef enum e_stat_timer
+{
+    stat_chunk_latency = 0, // From crediting a chunk to receiving all of it
+    stat_encode, // Encoding one bitmap
+    stat_sector_write, // Saving one received chunk
+    stat_timer_count
+} StatTimer;
+
+typedef struct s_stat_timing
+{
+    // Structure accumulating the durations measured by a timer, in microseconds
+    uint32_t count;
+    uint32_t total;
+    uint32_t max;
+} StatTiming;
+
+#if STATS_ENABLED
+#define STAT_COUNT(counter, amount) statCount(counter, amount)
+#define STAT_TIME_START(name) uint32_t const name = micros()
+#define STAT_TIME(timer, started) statTime(timer, micros() - (started))
+#else
+#define STAT_COUNT(counter, amount) ((void)0)
+#define STAT_TIME_START(name) ((void)0)
+#define STAT_TIME(timer, started) ((void)0)
+#endif
+
+// Counters and timers, to be used through the STAT_ macros
+void statCount(StatCounter counter, uint32_t amount);
+void statTime(StatTimer timer, uint32_t duration);
+uint32_t statGetCount(StatCounter counter);
+StatTiming const &statGetTiming(StatTimer timer);
+void statReset();
+
+#endif
@@ -1,10 +1,23 @@
 #include "Storage.h"
 #include "Config.h"
 #include "Display.h"
+#include "Scanline.h"
+#include "Checksum.h"
+#include "Stats.h"
 
-SdFatSoftSpi<SOFT_MISO_PIN, SOFT_MOSI_PIN, SOFT_SCK_PIN> SD;
+// SD card driver, replaceable to run Storage against another SdFat backend or a mock of it
+#ifndef STORAGE_SD_CLASS
+#define STORAGE_SD_CLASS SdFatSoftSpi<SOFT_MISO_PIN, SOFT_MOSI_PIN, SOFT_SCK_PIN>
+#endif
+STORAGE_SD_CLASS SD;
 
 #include <string.h>
+#include <ctype.h>
+
+// Initial size of the row buffer, one padded monochrome row of the screen
+#ifndef STORAGE_ROW_BUFFER_SIZE
+#define STORAGE_ROW_BUFFER_SIZE ((SCREEN_X + 31) / 32 * 4)
+#endif
 
 /**
  * @brief      Determines if file is a bitmap
@@ -19,6 +32,87 @@ static bool _isBitmap(File &file)
     return file.read() == 'B' && file.read() == 'M';
 }
 
+/**
+ * @brief      Calculates a CRC16 of the whole content of a file
+ *
+ * @param      file  Reference to the file, left positioned at its end
+ *
+ * @return     CRC16 of the file
+ */
+static uint16_t _hashFile(File &file)
+{
+    uint8_t buffer[STORAGE_SECTOR_SIZE];
+    uint16_t crc = 0xFFFF;
+    file.seek(0);
+    int read_amount;
+    while ((read_amount = file.read(buffer, STORAGE_SECTOR_SIZE)) > 0)
+    {
+        crc = crc16(buffer, read_amount, crc);
+    }
+    return crc;
+}
+
+/**
+ * @brief      Finds the name of a file in the root, as recorded in the encoded bitmap index
+ *
+ * @param      filepath  Filepath of the file
+ *
+ * @return     Filename without the leading slash, nullptr if the file is not in the root
+ */
+static char *_rootFilename(char filepath[])
+{
+    char * const filename = (filepath[0] == '/') ? filepath + 1 : filepath;
+    return strchr(filename, '/') ? nullptr : filename;
+}
+
+/**
+ * @brief      Tells whether two filepaths name the same file
+ *
+ * Paths are relative to the root with or without a leading slash, and FAT ignores case.
+ *
+ * @return     True if both name the same file, False otherwise
+ */
+static bool _samePath(char const a[], char const b[])
+{
+    return strcasecmp(a + (a[0] == '/'), b + (b[0] == '/')) == 0;
+}
+
+/**
+ * @brief      Looks up a bitmap from the encoded bitmap index
+ *
+ * Records are kept in directory order, so the record following the previous
+ * match is checked first before searching the whole index.
+ *
+ * @param      index     Index file, positioned after the previous match
+ * @param      filename  Filename of the bitmap to look up
+ * @param      record    Matching record will be stored here
+ *
+ * @return     True if found, False otherwise
+ */
+static bool _findIndexRecord(File &index, char filename[], EncodedRecord &record)
+{
+    if (!index)
+    {
+        return false;
+    }
+
+    if (index.read((uint8_t *)&record, sizeof(record)) == sizeof(record) &&
+        strcmp(record.bitmapName, filename) == 0)
+    {
+        return true;
+    }
+
+    index.seek(0);
+    while (index.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+    {
+        if (strcmp(record.bitmapName, filename) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 Storage::Storage()
 {
     Serial.println("Initializing Storage...");
@@ -29,7 +123,21 @@ Storage::Storage()
         Serial.println("Failed to initialize SD card");
     }
 
-    this->bitmap.data = new uint8_t [1]; // Avoid freeing empty arrays
+    this->bitmap.data = nullptr;
+    this->raw_writing = false;
+    this->preallocated = 0;
+    this->row_buffer.capacity = 0;
+    this->row_buffer.high_water = 0;
+    this->row_buffer.grows = 0;
+    reserveRowBuffer(STORAGE_ROW_BUFFER_SIZE);
+    this->row_buffer.high_water = 0;
+    this->browse_valid = false;
+    this->browse_count = 0;
+    this->browse_position = 0;
+    this->cache_clock = 0;
+    invalidateCache();
+    this->mapping_arena = nullptr;
+    allocateMappingList(0, 0);
 
     // Compress all bitmaps found
     Display::instance().clear();
@@ -37,17 +145,106 @@ Storage::Storage()
     Display::instance().renderText("Do NOT turn off the power now!", SCREEN_X / 2, 220);
     delay(1000);
 
-    // Loop over all bitmaps found in the root
+    // Encode bitmaps that are new or changed since the last start
+    updateEncodedIndex();
+
+    // Create the monochrome color for Display if it doesn't exist
+    this->mono_color = 0xF800; // Red by default
+    char filename[20] = "monocolor";
+    if (openToRead(filename))
+    {
+        this->file.read((uint8_t *)&this->mono_color, 2);
+    }
+    else
+    {
+        File mono = openToWrite(filename, false);
+        mono.write((uint8_t *)&this->mono_color, 2);
+        mono.close();
+        // Serial.println("Wrote mono_color 0xF800 to file 'monocolor'");
+    }
+    closeRead();
+
+    Serial.println("...Storage initialized");
+}
+
+/**
+ * @brief      Encodes new and changed bitmaps found in the root
+ *
+ * Every file in the root is recorded into STORAGE_INDEX_FILE with its size,
+ * modification time and content hash. Files matching their record are skipped
+ * without opening them, so only new or changed bitmaps are inspected and encoded.
+ */
+void Storage::updateEncodedIndex()
+{
+    // Directory encoded bitmaps are saved and downloaded to
+    if (!SD.exists("/enc"))
+    {
+        SD.mkdir("enc");
+    }
+
+    // Records of older indices have another layout, so everything is indexed again
+    if (SD.exists(STORAGE_INDEX_LEGACY))
+    {
+        SD.remove(STORAGE_INDEX_LEGACY);
+    }
+    if (SD.exists(STORAGE_INDEX_NAMED))
+    {
+        SD.remove(STORAGE_INDEX_NAMED);
+    }
+
+    File index = SD.open(STORAGE_INDEX_FILE);
+    if (SD.exists(STORAGE_INDEX_TEMP))
+    {
+        SD.remove(STORAGE_INDEX_TEMP);
+    }
+    File index_new = SD.open(STORAGE_INDEX_TEMP, FILE_WRITE);
+    bool changed = !index;
+
+    // Loop over all files found in the root
     File root = SD.open("/");
     File entry = root.openNextFile();
     while (entry)
     {
-        if (_isBitmap(entry))
+        char filename[20];
+        entry.getName(filename, 20);
+        dir_t dir;
+        entry.dirEntry(&dir);
+        uint32_t const modified = ((uint32_t)dir.lastWriteDate << 16) | dir.lastWriteTime;
+
+        EncodedRecord record;
+        bool const known = _findIndexRecord(index, filename, record);
+        if (entry.isDirectory() ||
+            strcmp(filename, STORAGE_INDEX_FILE) == 0 || strcmp(filename, STORAGE_INDEX_TEMP) == 0)
         {
-            char filename[20];
-            entry.getName(filename, 20);
-            // getBitmap automatically compresses if it is already not done
-            getBitmap(filename, 0, 0);
+            // Not a candidate for encoding
+        }
+        else if (known && record.size == entry.size() && record.modified == modified)
+        {
+            // Unchanged since the last start
+            index_new.write((uint8_t *)&record, sizeof(record));
+        }
+        else
+        {
+            changed = true;
+            memset(&record, 0, sizeof(record));
+            strcpy(record.bitmapName, filename);
+            record.size = entry.size();
+            record.modified = modified;
+            record.hash = _hashFile(entry);
+
+            if (_isBitmap(entry))
+            {
+                char filepath_encoded[50];
+                getEncodedPath(filename, filepath_encoded);
+                if (known && SD.exists(filepath_encoded))
+                {
+                    // Bitmap has changed, encode it again
+                    SD.remove(filepath_encoded);
+                }
+                // getBitmap automatically compresses if it is already not done
+                getBitmap(filename, 0, 0);
+            }
+            index_new.write((uint8_t *)&record, sizeof(record));
         }
 
         // Open next file
@@ -56,143 +253,157 @@ Storage::Storage()
     entry.close();
     root.close();
 
-    // Create the monochrome color for Display if it doesn't exist
-    uint16_t mono_color = 0xF800; // Red by default
-    char filename[20] = "monocolor";
-    if (!fileOpenToRead(filename))
+    // Replace the index only if something was encoded or removed
+    changed = changed || (index && index.size() != index_new.size());
+    index.close();
+    index_new.close();
+    if (changed)
     {
-        fileOpenToWrite(filename);
-        fileWriteData((uint8_t *)&mono_color, 2);
-        fileClose();
-        // Serial.println("Wrote mono_color 0xF800 to file 'monocolor'");
+        SD.remove(STORAGE_INDEX_FILE);
+        SD.rename(STORAGE_INDEX_TEMP, STORAGE_INDEX_FILE);
+    }
+    else
+    {
+        SD.remove(STORAGE_INDEX_TEMP);
     }
-
-    Serial.println("...Storage initialized");
 }
 
 /**
- * @brief      Reads DIB type
+ * @brief      Marks the index record of a file as stale after the file has been written
  *
- * @param      file Reference to the file
+ * Files written without a clock keep the same modification time, so the size is
+ * cleared instead. The file is then indexed again on the next start and its hash
+ * is calculated from the content until then.
  *
- * @return     Size of DIB in bytes
+ * @param      filepath  Filepath of the file
  */
-static uint16_t _readDIB(File &file)
+void Storage::invalidateIndexRecord(char filepath[])
 {
-    // Print DIB size for debugging
-    file.seek(0x0E);
-    uint16_t size_DIB =
-        ((uint16_t)file.read() << 0) +
-        ((uint16_t)file.read() << 8);
-    return size_DIB;
-}
+    char * const filename = _rootFilename(filepath);
+    if (!filename || strcmp(filename, STORAGE_INDEX_FILE) == 0)
+    {
+        return;
+    }
 
-/**
- * @brief      Reads offset where bitmap data begins
- *
- * @param      file Reference to the file
- *
- * @return     Offset value
- */
-static uint32_t _readOffset(File &file)
-{
-    // Read offset where the data begins
-    file.seek(0x0A);
-    uint32_t offset =
-        ((uint32_t)file.read()) +
-        ((uint32_t)file.read() << 8) +
-        ((uint32_t)file.read() << 16) +
-        ((uint32_t)file.read() << 24);
-    return offset;
+    File index = SD.open(STORAGE_INDEX_FILE, O_RDWR);
+    EncodedRecord record;
+    if (_findIndexRecord(index, filename, record) && record.size != 0xFFFFFFFF)
+    {
+        record.size = 0xFFFFFFFF;
+        index.seek(index.position() - sizeof(record));
+        index.write((uint8_t *)&record, sizeof(record));
+    }
+    index.close();
 }
 
 /**
- * @brief      Reads bitmap width if known bitmap type
+ * @brief      Returns a CRC16 of the content of a file
  *
- * @param      file Reference to the file
+ * Files in the root are looked up from the encoded bitmap index first, so their
+ * content is only read if they have been written since the index was updated.
  *
- * @return     Width of bitmap
+ * @param      filepath  Filepath of the file
+ *
+ * @return     CRC16 of the file, 0xFFFF for an empty or missing file
  */
-static int32_t _readWidth(File &file)
+uint16_t Storage::getFileHash(char filepath[])
 {
-    if (_readDIB(file) == 40)
+    if (!openToRead(filepath))
     {
-        file.seek(0x12);
-        return
-            ((int32_t)file.read()) +
-            ((int32_t)file.read() << 8) +
-            ((int32_t)file.read() << 16) +
-            ((int32_t)file.read() << 24);
+        return 0xFFFF;
     }
-    else
+
+    char * const filename = _rootFilename(filepath);
+    if (filename)
     {
-        return -1;
+        File index = SD.open(STORAGE_INDEX_FILE);
+        EncodedRecord record;
+        bool const known = _findIndexRecord(index, filename, record) && record.size == this->file.size();
+        index.close();
+        if (known)
+        {
+            return record.hash;
+        }
     }
+    return _hashFile(this->file);
 }
 
 /**
- * @brief      Reads bitmap height if known bitmap type
+ * @brief      Reads a little-endian 16-bit value from a buffer
  *
- * @param      file Reference to the file
+ * @param      data      Buffer to read from
+ * @param      position  Position of the value
  *
- * @return     Height of bitmap
+ * @return     Value read
  */
-static int32_t _readHeight(File &file)
+static inline uint16_t _readUint16(uint8_t const data[], uint8_t position)
 {
-    if (_readDIB(file) == 40)
-    {
-        file.seek(0x16);
-        int32_t height =
-            ((int32_t)file.read()) +
-            ((int32_t)file.read() << 8) +
-            ((int32_t)file.read() << 16) +
-            ((int32_t)file.read() << 24);
-
-        // Height might be negative
-        // See BITMAPV4HEADER references or similar
-        // Some weird interaction also with abs() and int32_t
-        // Produced totally erroneous results
-        if (height < 0)
-            height = -height;
-        return height;
-    }
-    else
-    {
-        return -1;
-    }
+    return
+        ((uint16_t)data[position]) +
+        ((uint16_t)data[position + 1] << 8);
 }
 
 /**
- * @brief      Read how many bits are used for each pixel
+ * @brief      Reads a little-endian 32-bit value from a buffer
  *
- * @param      file Reference to the file
+ * @param      data      Buffer to read from
+ * @param      position  Position of the value
  *
- * @return     Amount of bits used per pixel
+ * @return     Value read
  */
-static uint8_t _readBitsPerPixel(File &file)
+static inline uint32_t _readUint32(uint8_t const data[], uint8_t position)
 {
-    // Read how many bits are there per pixel in the file
-    if (_readDIB(file) == 40)
-    {
-        file.seek(0x1C);
-        return file.read();
-    }
+    return
+        ((uint32_t)data[position]) +
+        ((uint32_t)data[position + 1] << 8) +
+        ((uint32_t)data[position + 2] << 16) +
+        ((uint32_t)data[position + 3] << 24);
 }
 
 /**
- * @brief      Read what compression method the bitmap uses
+ * @brief      Parses the header of the currently open bitmap, unless already done
  *
- * @param      file Reference to the file
+ * The whole header is read at once and kept until another file is opened,
+ * so repeated reads of the same bitmap don't seek around the header again.
  *
- * @return     Compression method type
+ * @return     True if the file has a known header, False otherwise
  */
-static uint8_t _readCompressionMethod(File &file)
+bool Storage::readHeader()
 {
-    if (_readDIB(file) == 40)
+    if (this->header.valid)
+    {
+        return true;
+    }
+
+    uint8_t data[BITMAP_HEADER_SIZE];
+    this->file.seek(0);
+    if (this->file.read(data, BITMAP_HEADER_SIZE) != BITMAP_HEADER_SIZE ||
+        data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+
+    this->header.offset = _readUint32(data, 0x0A);
+    this->header.dib_size = _readUint16(data, 0x0E);
+    if (this->header.dib_size != 40)
     {
-        file.seek(0x1E);
-        return file.read();
+        // Only BITMAPINFOHEADER is known
+        return false;
     }
+
+    this->header.width = _readUint32(data, 0x12);
+    // Height might be negative
+    // See BITMAPV4HEADER references or similar
+    int32_t height = _readUint32(data, 0x16);
+    if (height < 0)
+        height = -height;
+    this->header.height = height;
+    this->header.bits_per_pixel = _readUint16(data, 0x1C);
+    this->header.compression_method = _readUint32(data, 0x1E);
+    // Rows are padded to 32 bits
+    this->header.row_stride = 4 * (((uint32_t)this->header.width * this->header.bits_per_pixel + 31) / 32);
+    this->header.valid = true;
+    return true;
 }
 
 /**
@@ -209,637 +420,2735 @@ static uint16_t _RGB888ToRGB565(uint8_t red, uint8_t green, uint8_t blue)
 }
 
 /**
- * @brief      Writes a compressed block of data into a specified file
+ * @brief      Appends a byte to a buffer, flushing it into a file when full
+ *
+ * @param      encoded   File to flush the buffer into
+ * @param      buffer    Buffer of STORAGE_SECTOR_SIZE bytes to append into
+ * @param      buffered  Amount of bytes in the buffer
+ * @param      value     Byte to append
+ */
+void Storage::writeEncodedByte(File &encoded, uint8_t buffer[], uint16_t &buffered, uint8_t value)
+{
+    buffer[buffered++] = value;
+
+    // Only flush full buffers so that writes stay sector aligned
+    if (buffered == STORAGE_SECTOR_SIZE)
+    {
+        encoded.write(buffer, buffered);
+        buffered = 0;
+    }
+}
+
+/**
+ * @brief      Appends a value to a buffer as a varint, flushing it into a file when full
+ *
+ * Varints hold 7 bits per byte, least significant first, with the top bit set
+ * on all but the last byte.
  *
- * @param      filename  The filename to write into
- * @param      row       The row to write into the data
- * @param      start     The start offset of the scanline
- * @param      end       The end offset of the scanline
+ * @param      encoded   File to flush the buffer into
+ * @param      buffer    Buffer of STORAGE_SECTOR_SIZE bytes to append into
+ * @param      buffered  Amount of bytes in the buffer
+ * @param      value     Value to append
  */
-void Storage::writeCompressedBlock(char filename[], uint16_t row, uint16_t start, uint16_t end)
+void Storage::writeVarint(File &encoded, uint8_t buffer[], uint16_t &buffered, uint16_t value)
 {
-    // Write compressed data into file
-    fileOpenToWrite(filename);
-    uint8_t data[8] = { (uint8_t)row, (uint8_t)((row & 0xFF00) >> 8),
-                        (uint8_t)start, (uint8_t)((start & 0xFF00) >> 8),
-                        (uint8_t)end, (uint8_t)((end & 0xFF00) >> 8),
-                        0xFF, 0xFF }; // Some padding required to achieve 32-bit writes
-    fileWriteData(data, 8);
+    do
+    {
+        writeEncodedByte(encoded, buffer, buffered, (value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+        value >>= 7;
+    } while (value > 0);
 }
 
 /**
- * @brief      Translate index to pixel memory position
+ * @brief      Wraps a file as a source of encoded data
  *
- * @param      x     Index to translate
+ * @param      file  Open file
  *
- * @return     Index in memory
+ * @return     Source reading from the file
  */
-static inline int16_t _translate(uint32_t x)
+static EncodedSource _fileSource(File &file)
 {
-    return ((x / 8) * 2 + 1) * 8 - 1 - x;
+    EncodedSource source;
+    source.file = &file;
+    return source;
 }
 
 /**
- * @brief      Get specific bit state from an array of data. Might overflow!
+ * @brief      Wraps a file as a source of encoded data read through a sector buffer of its own
+ *
+ * Whole sectors are read straight into block, bypassing the single block cache of
+ * the volume, so that another file can be read through the cache alongside without
+ * both reloading their sectors in turn.
  *
- * @param      data   Data to iterate over
- * @param      index  Index to retrieve
+ * @param      file   Open file
+ * @param      block  Buffer of STORAGE_SECTOR_SIZE bytes
  *
- * @return     State of bit on requested index.
+ * @return     Source reading from the file
  */
-static inline bool _bitset(uint8_t const * const data, uint16_t index)
+static EncodedSource _blockSource(File &file, uint8_t block[])
 {
-    return (data[index / 8] & (1 << index % 8)) != 0;
+    EncodedSource source;
+    source.file = &file;
+    source.size = file.size();
+    source.block = block;
+    return source;
 }
 
 /**
- * @brief      Finds the first set or clear pixel from given data 
+ * @brief      Reads the sector holding the read position into the buffer of a source
  *
- * @param      data        Data to iterate over
- * @param      pixel_state State of the pixel, set/clear (true/false)
- * @param      index       Index to start searching from
+ * @param      source  Source of encoded data read through a sector buffer
+ *
+ * @return     True if the read position lies in the buffer, False at the end
  */
-uint16_t Storage::findPixel(bool pixel_state, int16_t index)
+static bool _sourceFill(EncodedSource &source)
 {
-    while(_bitset(bitmap.data, _translate(index)) != pixel_state)
+    if (source.position - source.block_start < source.block_size)
     {
-        ++index;
+        return true;
     }
-    return index;
+    source.block_start = source.position - source.position % STORAGE_SECTOR_SIZE;
+    source.file->seek(source.block_start);
+    STAT_COUNT(stat_sd_reads, 1);
+    int32_t const amount = source.file->read(source.block, STORAGE_SECTOR_SIZE);
+    source.block_size = amount > 0 ? amount : 0;
+    STAT_COUNT(stat_sd_read_bytes, source.block_size);
+    return source.position - source.block_start < source.block_size;
 }
 
 /**
- * @brief      Finds a scanline from the current bitmap and given row
+ * @brief      Gets the size of a source of encoded data
  *
- * @param      row     Row to search for scanlines
- * @param      start   Starting pixel location will be stored here
- * @param      end     Ending pixel location will be stored here
- * @param      index   Index to start searching from
+ * @param      source  Source of encoded data
+ *
+ * @return     Size in bytes
  */
-void Storage::findScanline(int16_t row, int16_t &start, int16_t &end, int16_t index)
+static inline uint32_t _sourceSize(EncodedSource &source)
 {
-    // Read data of one row
-    readMono40(row, 1);
-
-    // Find start
-    start = findPixel(true, index);
-    // Find end
-    end = findPixel(false, start + 1);
+    return (source.file && !source.block) ? source.file->size() : source.size;
 }
 
 /**
- * @brief      Reads a monochrome bitmap of BITMAPINFOHEADER and compresses the data
+ * @brief      Gets the read position of a source of encoded data
  *
- * @param      row          Row where to start reading data
- * @param      amount       Amount of rows to read
+ * @param      source  Source of encoded data
+ *
+ * @return     Read position in bytes
  */
-void Storage::readMono40(uint16_t row, uint16_t amount)
+static inline uint32_t _sourcePosition(EncodedSource &source)
 {
-    uint32_t const width = _readWidth(this->file);
-    uint8_t const offset = _readOffset(this->file);
-    // Read and convert data
-    uint16_t counter = 0; // Keep track of memory position
-    delete[] this->bitmap.data;
-    this->bitmap.data = new uint8_t [width / 8 + 1];
-    // Calculate starting address
-    this->file.seek(offset + row * (4 * (1 + width / 32)));
+    return (source.file && !source.block && source.position >= source.prefix) ? source.file->position() : source.position;
+}
 
-    // Read requested amount of data
-    while(this->file.available() && counter < amount * width)
+/**
+ * @brief      Moves the read position of a source of encoded data
+ *
+ * @param      source    Source of encoded data
+ * @param      position  New read position, clamped to the size
+ */
+static inline void _sourceSeek(EncodedSource &source, uint32_t position)
+{
+    if (source.file && !source.block)
     {
-        // Encoded as End-of-line
-        // Read one line at a time
-        uint16_t bytes_read = 0;
-        if (width >= 8)
+        // Positions in the part held in memory are read from there
+        source.position = min(position, source.prefix);
+        if (position >= source.prefix)
         {
-            while (bytes_read < (width / 8))
-            {
-                this->bitmap.data[counter++] = this->file.read();
-                bytes_read++;
-            }
-        }
-
-        // Check if width is uneven and still contains leftover bits
-        uint8_t leftover = width % 8;
-        if (leftover > 0)
-        {
-            this->bitmap.data[counter++] = this->file.read();
-            bytes_read++;
-        }
-
-        if (bytes_read % 4 > 0)
-        {
-            // Hop forward over padding to the position of the next line
-            this->file.seek(this->file.position() + 4 - (bytes_read % 4));
+            STAT_COUNT(stat_sd_seeks, 1);
+            source.file->seek(position);
         }
     }
+    else
+        source.position = min(position, source.size);
 }
 
 /**
- * @brief      Encodes the bitmap into scanline format
+ * @brief      Reads a byte from a source of encoded data
  *
- * @param      filename_original  Filename of original bitmap
- * @param      filename_encoded   Filename for the encoded bitmap
+ * @param      source  Source of encoded data
+ *
+ * @return     The byte, -1 at the end
  */
-void Storage::encodeBitmap(char filename_original[], char filename_encoded[])
+static inline int _sourceRead(EncodedSource &source)
 {
-    Serial.print("Encoding: ");
-    Serial.println(filename_original);
-
-    for (uint16_t row = 0; row  < bitmap.height; ++row)
+    if (source.position < source.prefix)
     {
-        int16_t start = 0, end = 0, offset = 0;
-        while (start < bitmap.width)
-        {
-            findScanline(row, start, end, offset);
-            if (start < end && start < bitmap.width && end <= bitmap.width)
-            {
-                writeCompressedBlock(filename_encoded, row, start, end);
-                fileOpenToRead(filename_original);
-            }
-            offset = end + 1;
-        }
+        uint8_t const c = source.data[source.position++];
+        // Go on in the file where the part held in memory ends
+        if (source.position == source.prefix && !source.block)
+            source.file->seek(source.prefix);
+        return c;
     }
-
-    Serial.println("...done encoding!");
+    if (source.block)
+    {
+        if (!_sourceFill(source))
+            return -1;
+        uint8_t const c = source.block[source.position - source.block_start];
+        source.position++;
+        return c;
+    }
+    if (source.file)
+        return source.file->read();
+    return (source.position < source.size) ? source.data[source.position++] : -1;
 }
 
 /**
- * @brief      Reads a bitmap from a file
+ * @brief      Reads bytes from a source of encoded data
  *
- * @param      row          Row where to start reading data
- * @param      amount       Amount of rows to read
+ * @param      source  Source of encoded data
+ * @param      buffer  Buffer to read into
+ * @param      amount  Amount of bytes to read
+ *
+ * @return     Amount of bytes read
  */
-void Storage::readBitmap(uint16_t row, uint16_t amount)
+static int32_t _sourceRead(EncodedSource &source, void *buffer, uint16_t amount)
 {
-    uint32_t const width = _readWidth(this->file);
-    uint32_t const height = _readHeight(this->file);
-    uint8_t const bits_per_pixel = _readBitsPerPixel(this->file);
-    uint8_t const compression_method = _readCompressionMethod(this->file);
-    uint8_t const offset = _readOffset(this->file);
-
-    bitmap.width = width;
-    bitmap.height = height;
-
-    // Check if we know how to parse the format
-    if (bits_per_pixel == 1 && compression_method == 0)
+    uint16_t done = 0;
+    if (source.position < source.prefix)
     {
-        // Serial.println("Monochrome BITMAPINFOHEADER bitmap identified");
-        // Check if encoded version already exists
-        char filename_encoded[30];
-        char extension[5] = ".cbm";
-        char filename_original[30];
-        this->file.getName(filename_original, 30);
-
-        strcpy(filename_encoded, filename_original);
-        strtok(filename_encoded, ".");
-        strcat(filename_encoded, extension);
-
-        char filepath_encoded[50] = "/enc/";
-        strcat(filepath_encoded, filename_encoded);
-
-        if (SD.exists(filepath_encoded))
-        {
-            return;
-        }
-
-        if (!SD.exists("/enc"))
+        done = min((uint32_t)amount, source.prefix - source.position);
+        memcpy(buffer, source.data + source.position, done);
+        source.position += done;
+        if (source.position == source.prefix && !source.block)
+            source.file->seek(source.prefix);
+        if (done == amount)
+            return done;
+    }
+    if (source.block)
+    {
+        while (done < amount && _sourceFill(source))
         {
-            SD.mkdir("enc");
+            uint16_t const part = min((uint32_t)(amount - done), source.block_start + source.block_size - source.position);
+            memcpy((uint8_t *)buffer + done, source.block + (source.position - source.block_start), part);
+            source.position += part;
+            done += part;
         }
-        encodeBitmap(filename_original, filepath_encoded);
+        return done;
     }
-    else
+    if (source.file)
     {
-        Serial.println("Bitmap of unknown format! Unable to parse!");
+        STAT_COUNT(stat_sd_reads, 1);
+        STAT_COUNT(stat_sd_read_bytes, amount - done);
+        int32_t const read = source.file->read((uint8_t *)buffer + done, amount - done);
+        return (read < 0 && done == 0) ? read : done + max(read, (int32_t)0);
     }
+    amount = min((uint32_t)amount, source.size - source.position);
+    memcpy(buffer, source.data + source.position, amount);
+    source.position += amount;
+    return amount;
 }
 
 /**
- * @brief      Gets bitmap data from an image on the SD card.
+ * @brief      Reads a varint written by Storage::writeVarint
  *
- * @param      filepath   Filepath to read from.
- * @param      row        Row where to start reading data
- * @param      amount     Amount of pixels to read.
+ * @param      source  Encoded data to read from
  *
- * @return     Bitmap containing the data or an empty struct if failed
+ * @return     Value read
  */
-Bitmap const &Storage::getBitmap(char filepath[], uint16_t row, uint16_t amount)
+static uint16_t _readVarint(EncodedSource &source)
 {
-    if (!this->fileOpenToRead(filepath))
+    uint16_t value = 0;
+    for (uint8_t shift = 0; shift < 16; shift += 7)
     {
-        this->bitmap.width = -1;
-        this->bitmap.height = -1;
-        this->bitmap.type = BitmapType::file_error;
-        return this->bitmap;
+        int c = _sourceRead(source);
+        if (c < 0)
+        {
+            break;
+        }
+        value |= (uint16_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+        {
+            break;
+        }
     }
-
-    readBitmap(row, amount);
-    return this->bitmap;
+    return value;
 }
 
 /**
- * @brief      Opens a file for reading if it hasn't yet been opened
+ * @brief      Makes sure the row buffer behind bitmap.data holds at least the given amount of bytes
  *
- * @param      filepath  Filepath of the file
+ * The buffer is only ever grown, so that reading rows doesn't fragment the heap.
  *
- * @return     True on success, False otherwise
+ * @param      bytes  Amount of bytes needed
+ *
+ * @return     True on success, False if out of memory
  */
-bool Storage::fileOpenToRead(char filepath[])
+bool Storage::reserveRowBuffer(uint32_t bytes)
 {
-    char filepath_open[20];
-    this->file.getName(filepath_open, 20);
-
-    if (strcmp(filepath_open, filepath) == 0)
+    if (bytes > UINT16_MAX)
+    {
+        Serial.println("Row buffer too large!");
+        return false;
+    }
+    this->row_buffer.high_water = max(this->row_buffer.high_water, (uint16_t)bytes);
+    if (bytes <= this->row_buffer.capacity)
     {
-        // Same file as previously
-        // Therefore, it should already be open
-        // Just seek to beginning because of new request to open
-        this->file.seek(0);
         return true;
     }
 
-    // Different file than previously
-    // Close previous one and open a new one
-    this->file.close();
-    this->file = SD.open(filepath);
-    if (!this->file)
+    delete[] this->bitmap.data;
+    this->bitmap.data = new uint8_t [bytes];
+    if (!this->bitmap.data)
     {
-        Serial.print("Failed to open file: ");
-        Serial.println(filepath);
+        Serial.println("Failed to allocate row buffer!");
+        this->row_buffer.capacity = 0;
         return false;
     }
-    // Serial.print("Opening file: ");
-    // Serial.println(filepath);
+    if (this->row_buffer.capacity > 0)
+    {
+        this->row_buffer.grows++;
+    }
+    this->row_buffer.capacity = bytes;
     return true;
 }
 
 /**
- * @brief      Opens a file for writing
- *
- * @param      filepath  Filepath of the file
- * @param      overwrite Overwrite file if it exists
+ * @brief      Gets usage statistics of the buffer holding bitmap data
  *
- * @return     True on success, False otherwise
+ * @return     Capacity, high-water mark and amount of reallocations of the buffer
  */
-bool Storage::fileOpenToWrite(char filepath[], bool overwrite)
+RowBufferStats Storage::getRowBufferStats()
 {
-    if (SD.exists(filepath) && overwrite)
+    return this->row_buffer;
+}
+
+/**
+ * @brief      Reads rows of a monochrome bitmap of BITMAPINFOHEADER without padding
+ *
+ * Rows are stored one after another in bitmap.data, (width + 7) / 8 bytes each,
+ * with the leftmost pixel in the most significant bit.
+ *
+ * @param      row          Row where to start reading data
+ * @param      amount       Amount of rows to read
+ */
+void Storage::readMono40(uint16_t row, uint16_t amount)
+{
+    if (!readHeader())
+    {
+        return;
+    }
+    uint16_t const row_bytes = (this->header.width + 7) / 8;
+    uint16_t const stride = this->header.row_stride;
+    this->bitmap.first_row = row;
+    this->bitmap.rows = 0;
+    // Padding of each row is read into the start of the next one, so leave room for the last
+    if (amount == 0 || !reserveRowBuffer((uint32_t)(amount - 1) * row_bytes + stride))
+    {
+        return;
+    }
+
+    // Rows are contiguous, so one seek serves the whole batch
+    STAT_COUNT(stat_sd_seeks, 1);
+    this->file.seek(this->header.offset + (uint32_t)row * stride);
+    uint8_t *data = this->bitmap.data;
+    while (this->bitmap.rows < amount && this->file.read(data, stride) == stride)
+    {
+        data += row_bytes;
+        this->bitmap.rows++;
+    }
+    STAT_COUNT(stat_sd_reads, this->bitmap.rows);
+    STAT_COUNT(stat_sd_read_bytes, (uint32_t)this->bitmap.rows * stride);
+}
+
+/**
+ * @brief      Finds the first record of a version 1 encoded bitmap at or after a row
+ *
+ * Records are sorted by row, so a binary search needs only a few seeks.
+ *
+ * @param      source   Open encoded bitmap
+ * @param      records  Amount of records in the file
+ * @param      row      Row to search for
+ *
+ * @return     Index of the first record with a row not less than row
+ */
+static uint32_t _findEncodedRow(EncodedSource &source, uint32_t records, uint16_t row)
+{
+    uint32_t low = 0;
+    uint32_t high = records;
+    while (low < high)
+    {
+        uint32_t const middle = low + (high - low) / 2;
+        uint8_t data[2];
+        _sourceSeek(source, middle * CBM_RECORD_SIZE);
+        _sourceRead(source, data, 2);
+        if ((uint16_t)(data[0] | (data[1] << 8)) < row)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * @brief      Reads the trailer locating the row index of an encoded bitmap
+ *
+ * Version 1 files encoded before the row index existed have no trailer. The last
+ * two bytes of a version 1 record are always 0xFF, which can't end a trailer.
+ *
+ * @param      source        Open encoded bitmap
+ * @param      rows          Amount of rows of the bitmap will be stored here
+ * @param      index_offset  Offset of the row index will be stored here
+ *
+ * @return     True if the file has a row index, False otherwise
+ */
+static bool _readEncodedTrailer(EncodedSource &source, uint16_t &rows, uint32_t &index_offset)
+{
+    uint32_t const size = _sourceSize(source);
+    uint8_t data[CBM_TRAILER_SIZE];
+    if (size < CBM_TRAILER_SIZE)
+    {
+        return false;
+    }
+    _sourceSeek(source, size - CBM_TRAILER_SIZE);
+    if (_sourceRead(source, data, CBM_TRAILER_SIZE) != CBM_TRAILER_SIZE ||
+        data[2] != 'R' || data[3] != 'X' || (data[6] == 0xFF && data[7] == 0xFF))
+    {
+        return false;
+    }
+    rows = data[0] | (data[1] << 8);
+    index_offset = _readUint32(data, 4);
+    return index_offset + 4 * ((rows + CBM_INDEX_STRIDE - 1) / CBM_INDEX_STRIDE) + CBM_TRAILER_SIZE == size;
+}
+
+/**
+ * @brief      Finds the first record of a version 1 encoded bitmap at or after a row using its row index
+ *
+ * One seek into the index, then at most CBM_INDEX_STRIDE rows of records are skipped.
+ *
+ * @param      source        Open encoded bitmap
+ * @param      rows          Amount of rows of the bitmap
+ * @param      index_offset  Offset of the row index, which is also where records end
+ * @param      row           Row to search for
+ *
+ * @return     Index of the first record with a row not less than row
+ */
+static uint32_t _findIndexedRow(EncodedSource &source, uint16_t rows, uint32_t index_offset, uint16_t row)
+{
+    if (row >= rows)
+    {
+        return index_offset / CBM_RECORD_SIZE;
+    }
+
+    uint8_t data[CBM_RECORD_SIZE];
+    _sourceSeek(source, index_offset + 4 * (row / CBM_INDEX_STRIDE));
+    _sourceRead(source, data, 4);
+    uint32_t record = _readUint32(data, 0) / CBM_RECORD_SIZE;
+
+    _sourceSeek(source, record * CBM_RECORD_SIZE);
+    while (record < index_offset / CBM_RECORD_SIZE &&
+           _sourceRead(source, data, CBM_RECORD_SIZE) == CBM_RECORD_SIZE &&
+           (uint16_t)(data[0] | (data[1] << 8)) < row)
+    {
+        record++;
+    }
+    return record;
+}
+
+/**
+ * @brief      Skips the scanlines of one row of a version 2 encoded bitmap
+ *
+ * @param      source Open encoded bitmap, positioned at the start of the row
+ * @param      flags  Flags of the .cbm header
+ */
+static void _skipEncodedRow(EncodedSource &source, uint8_t flags)
+{
+    for (uint16_t runs = _readVarint(source); runs > 0; --runs)
+    {
+        _readVarint(source);
+        _readVarint(source);
+        if (flags & CBM_FLAG_COLOR)
+        {
+            _sourceSeek(source, _sourcePosition(source) + 2);
+        }
+    }
+}
+
+/**
+ * @brief      Appends the row index and its trailer to a version 2 encoded bitmap
+ *
+ * Entry i holds the offset of row i * CBM_INDEX_STRIDE. Offsets are found by
+ * reading back the rows just written, so the encoder needs no memory for them.
+ *
+ * @param      encoded  .cbm file holding all scanlines, open for writing
+ * @param      rows     Amount of rows of the bitmap
+ * @param      flags    Flags of the .cbm header
+ * @param      buffer   Buffer of STORAGE_SECTOR_SIZE bytes to collect entries in
+ */
+static void _writeEncodedIndex(File &encoded, uint16_t rows, uint8_t flags, uint8_t buffer[])
+{
+    uint32_t const index_offset = encoded.size();
+    uint32_t offset = CBM_HEADER_SIZE;
+    uint16_t buffered = 0;
+    EncodedSource source = _fileSource(encoded);
+    encoded.seek(offset);
+    for (uint16_t row = 0; row < rows; ++row)
+    {
+        if (row % CBM_INDEX_STRIDE == 0)
+        {
+            buffer[buffered++] = offset;
+            buffer[buffered++] = offset >> 8;
+            buffer[buffered++] = offset >> 16;
+            buffer[buffered++] = offset >> 24;
+            if (buffered == STORAGE_SECTOR_SIZE)
+            {
+                encoded.seekEnd();
+                encoded.write(buffer, buffered);
+                buffered = 0;
+                encoded.seek(offset);
+            }
+        }
+        _skipEncodedRow(source, flags);
+        offset = encoded.position();
+    }
+
+    uint8_t const trailer[CBM_TRAILER_SIZE] = { (uint8_t)rows, (uint8_t)(rows >> 8), 'R', 'X',
+                                                (uint8_t)index_offset, (uint8_t)(index_offset >> 8),
+                                                (uint8_t)(index_offset >> 16), (uint8_t)(index_offset >> 24) };
+    encoded.seekEnd();
+    // The trailer goes together with the last offsets, unless they fill the buffer
+    if (buffered + CBM_TRAILER_SIZE > STORAGE_SECTOR_SIZE)
+    {
+        encoded.write(buffer, buffered);
+        buffered = 0;
+    }
+    memcpy(buffer + buffered, trailer, CBM_TRAILER_SIZE);
+    encoded.write(buffer, buffered + CBM_TRAILER_SIZE);
+}
+
+/**
+ * @brief      Starts decoding the scanlines of an encoded bitmap from a row
+ *
+ * Both the version 1 format of fixed 8 byte records and the version 2 format
+ * with a header and varint scanlines grouped per row are understood.
+ *
+ * @param      from  Open encoded bitmap, copied into the decoding state
+ * @param      runs  Decoding state to initialize
+ * @param      row   First row to decode
+ *
+ * @return     True on success, False if the file isn't a known format
+ */
+static bool _openRuns(EncodedSource const &from, RunIterator &runs, uint16_t row)
+{
+    runs = RunIterator();
+    runs.source = from;
+    EncodedSource &source = runs.source;
+
+    uint16_t rows = 0;
+    uint32_t index_offset = 0;
+    uint8_t header[CBM_HEADER_SIZE];
+    _sourceSeek(source, 0);
+    if (_sourceRead(source, header, CBM_HEADER_SIZE) == CBM_HEADER_SIZE && header[0] == 'C' && header[1] == 'B')
+    {
+        if (header[2] != 2)
+        {
+            return false;
+        }
+        runs.version = 2;
+        runs.flags = header[3];
+        runs.width = _readUint16(header, 4);
+        runs.height = _readUint16(header, 6);
+        runs.data_end = _sourceSize(source);
+        uint32_t offset = CBM_HEADER_SIZE;
+        if ((header[3] & CBM_FLAG_ROW_INDEX) && _readEncodedTrailer(source, rows, index_offset))
+        {
+            runs.data_end = index_offset;
+            if (row >= rows)
+            {
+                offset = index_offset;
+                runs.next_row = runs.height;
+            }
+            else
+            {
+                uint8_t data[4];
+                _sourceSeek(source, index_offset + 4 * (row / CBM_INDEX_STRIDE));
+                _sourceRead(source, data, 4);
+                offset = _readUint32(data, 0);
+                runs.next_row = row - row % CBM_INDEX_STRIDE;
+            }
+        }
+
+        _sourceSeek(source, offset);
+        while (runs.next_row < row && runs.next_row < runs.height && _sourcePosition(source) < runs.data_end)
+        {
+            _skipEncodedRow(source, runs.flags);
+            runs.next_row++;
+        }
+        return true;
+    }
+
+    // Files without a header are plain records
+    runs.version = 1;
+    uint32_t records = _sourceSize(source) / CBM_RECORD_SIZE;
+    bool const indexed = _readEncodedTrailer(source, rows, index_offset) && index_offset % CBM_RECORD_SIZE == 0;
+    if (indexed)
+    {
+        records = index_offset / CBM_RECORD_SIZE;
+        runs.height = rows;
+    }
+    else if (records > 0)
+    {
+        // Width isn't stored, but the last record tells the height
+        uint8_t data[2];
+        _sourceSeek(source, (records - 1) * CBM_RECORD_SIZE);
+        _sourceRead(source, data, 2);
+        runs.height = _readUint16(data, 0) + 1;
+    }
+    runs.data_end = records * CBM_RECORD_SIZE;
+
+    uint32_t const first = indexed ? _findIndexedRow(source, rows, index_offset, row) : _findEncodedRow(source, records, row);
+    _sourceSeek(source, first * CBM_RECORD_SIZE);
+    return true;
+}
+
+/**
+ * @brief      Decodes the next scanline of an encoded bitmap
+ *
+ * @param      runs  Decoding state set up by _openRuns
+ * @param      run   Decoded scanline will be stored here
+ *
+ * @return     True on success, False after the last scanline
+ */
+static bool _nextRun(RunIterator &runs, Scanline &run)
+{
+    EncodedSource &source = runs.source;
+    if (runs.version == 1)
+    {
+        uint8_t data[CBM_RECORD_SIZE];
+        if (_sourcePosition(source) >= runs.data_end || _sourceRead(source, data, CBM_RECORD_SIZE) != CBM_RECORD_SIZE)
+        {
+            return false;
+        }
+        run.row = _readUint16(data, 0);
+        run.start = _readUint16(data, 2);
+        run.end = _readUint16(data, 4);
+        run.color = 0xFFFF;
+        return true;
+    }
+
+    while (runs.remaining == 0)
+    {
+        if (runs.next_row >= runs.height || _sourcePosition(source) >= runs.data_end)
+        {
+            return false;
+        }
+        runs.remaining = _readVarint(source);
+        runs.row = runs.next_row++;
+        runs.end = 0;
+    }
+
+    // Starts are relative to the end of the previous scanline of the row
+    run.row = runs.row;
+    run.start = runs.end + _readVarint(source);
+    run.end = run.start + _readVarint(source);
+    run.color = 0xFFFF;
+    if (runs.flags & CBM_FLAG_COLOR)
+    {
+        // Stored in the order sent to the display, so just copy it
+        _sourceRead(source, &run.color, 2);
+    }
+    runs.end = run.end;
+    runs.remaining--;
+    return true;
+}
+
+/**
+ * @brief      Decodes the next scanline of an encoded bitmap to be drawn
+ *
+ * @param      runs        Decoding state set up by _openRuns
+ * @param      run         Decoded scanline will be stored here
+ * @param      end_row     Row after the last one to decode
+ * @param      mono_color  Color given to the scanlines of monochrome bitmaps
+ *
+ * @return     True on success, False after the last scanline before end_row
+ */
+static bool _nextSpan(RunIterator &runs, Scanline &run, uint32_t end_row, uint16_t mono_color)
+{
+    if (!_nextRun(runs, run) || run.row >= end_row)
+    {
+        return false;
+    }
+    if (!(runs.flags & CBM_FLAG_COLOR))
+    {
+        run.color = mono_color;
+    }
+    return true;
+}
+
+/**
+ * @brief      Encodes the next row of the currently open monochrome bitmap
+ *
+ * The row is written as the amount of its scanlines followed by the gap from
+ * the previous scanline and the length of each one, all as varints.
+ *
+ * @param      encoded   File to flush the buffer into
+ * @param      buffer    Buffer of STORAGE_SECTOR_SIZE bytes to append into
+ * @param      buffered  Amount of bytes in the buffer
+ *
+ * @return     True on success, False if the bitmap ended prematurely
+ */
+bool Storage::encodeMonoRow(File &encoded, uint8_t buffer[], uint16_t &buffered)
+{
+    uint16_t const width = this->header.width;
+    uint16_t const stride = this->header.row_stride;
+    if (this->file.read(this->bitmap.data, stride) != stride)
+    {
+        return false;
+    }
+
+    // The amount of scanlines leads the row, so count them first
+    uint16_t count = 0;
+    uint16_t index = 0;
+    while (index < width)
+    {
+        uint16_t const start = scanlineFindPixel(this->bitmap.data, true, index, width);
+        if (start >= width)
+        {
+            break;
+        }
+        index = scanlineFindPixel(this->bitmap.data, false, start + 1, width) + 1;
+        count++;
+    }
+    writeVarint(encoded, buffer, buffered, count);
+
+    uint16_t previous_end = 0;
+    index = 0;
+    while (count-- > 0)
+    {
+        uint16_t const start = scanlineFindPixel(this->bitmap.data, true, index, width);
+        uint16_t const end = scanlineFindPixel(this->bitmap.data, false, start + 1, width);
+        writeVarint(encoded, buffer, buffered, start - previous_end);
+        writeVarint(encoded, buffer, buffered, end - start);
+        previous_end = end;
+        index = end + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief      Encodes the next row of the currently open RGB888 bitmap
+ *
+ * Pixels are converted to RGB565 and runs of the same color are written like
+ * monochrome scanlines without gaps, each followed by its color high byte first.
+ * The row is read STORAGE_COLOR_SLICE pixels at a time, twice as the amount of
+ * scanlines leads the row.
+ *
+ * @param      encoded   File to flush the buffer into
+ * @param      buffer    Buffer of STORAGE_SECTOR_SIZE bytes to append into
+ * @param      buffered  Amount of bytes in the buffer
+ *
+ * @return     True on success, False if the bitmap ended prematurely
+ */
+bool Storage::encodeColorRow(File &encoded, uint8_t buffer[], uint16_t &buffered)
+{
+    uint16_t const width = this->header.width;
+    uint32_t const row_start = this->file.position();
+    uint16_t count = 0;
+    for (uint8_t pass = 0; pass < 2; ++pass)
+    {
+        this->file.seek(row_start);
+        if (pass == 1)
+        {
+            writeVarint(encoded, buffer, buffered, count);
+        }
+
+        uint16_t run_start = 0;
+        uint16_t color = 0;
+        for (uint16_t x = 0; x <= width; ++x)
+        {
+            uint16_t pixel = 0;
+            if (x < width)
+            {
+                if (x % STORAGE_COLOR_SLICE == 0)
+                {
+                    uint16_t const bytes = 3 * min(width - x, STORAGE_COLOR_SLICE);
+                    if (this->file.read(this->bitmap.data, bytes) != bytes)
+                    {
+                        return false;
+                    }
+                }
+                // Pixels are stored in BGR order
+                uint8_t const *bgr = this->bitmap.data + 3 * (x % STORAGE_COLOR_SLICE);
+                pixel = _RGB888ToRGB565(bgr[2], bgr[1], bgr[0]);
+            }
+
+            if (x == width || (x > 0 && pixel != color))
+            {
+                if (pass == 0)
+                {
+                    count++;
+                }
+                else
+                {
+                    writeVarint(encoded, buffer, buffered, 0);
+                    writeVarint(encoded, buffer, buffered, x - run_start);
+                    writeEncodedByte(encoded, buffer, buffered, color >> 8);
+                    writeEncodedByte(encoded, buffer, buffered, color);
+                }
+                run_start = x;
+            }
+            color = pixel;
+        }
+    }
+
+    this->file.seek(row_start + this->header.row_stride);
+    return true;
+}
+
+/**
+ * @brief      Encodes the currently open bitmap into scanline format
+ *
+ * Reads every row exactly once, see Storage::encodeMonoRow and
+ * Storage::encodeColorRow for the layout of the rows. Data is collected into
+ * a sector sized buffer which is flushed into the encoded file, which stays
+ * open for the whole encoding. A row index is appended afterwards so that
+ * readers can seek to any row.
+ *
+ * @param      filename_original  Filename of original bitmap
+ * @param      filename_encoded   Filename for the encoded bitmap
+ */
+void Storage::encodeBitmap(char filename_original[], char filename_encoded[])
+{
+    Serial.print("Encoding: ");
+    Serial.println(filename_original);
+
+    invalidateBrowseIndex();
+    invalidateCache();
+    File encoded = SD.open(filename_encoded, FILE_WRITE);
+    if (!encoded)
+    {
+        Serial.print("Failed to open file: ");
+        Serial.println(filename_encoded);
+        return;
+    }
+
+    bool const color = this->header.bits_per_pixel == 24;
+    if (!reserveRowBuffer(color ? 3 * STORAGE_COLOR_SLICE : this->header.row_stride))
+    {
+        encoded.close();
+        return;
+    }
+
+    uint16_t const width = this->header.width;
+    uint8_t const flags = CBM_FLAG_ROW_INDEX | (color ? CBM_FLAG_COLOR : 0);
+    uint8_t buffer[STORAGE_SECTOR_SIZE] = { 'C', 'B', CBM_VERSION, flags,
+                                            (uint8_t)width, (uint8_t)(width >> 8),
+                                            (uint8_t)bitmap.height, (uint8_t)(bitmap.height >> 8) };
+    uint16_t buffered = CBM_HEADER_SIZE;
+
+    this->file.seek(this->header.offset);
+    for (uint16_t row = 0; row < bitmap.height; ++row)
+    {
+        if (!(color ? encodeColorRow(encoded, buffer, buffered) : encodeMonoRow(encoded, buffer, buffered)))
+        {
+            Serial.println("Bitmap ended prematurely!");
+            break;
+        }
+    }
+
+    if (buffered > 0)
+    {
+        encoded.write(buffer, buffered);
+    }
+    _writeEncodedIndex(encoded, bitmap.height, flags, buffer);
+    encoded.close();
+
+    Serial.println("...done encoding!");
+}
+
+/**
+ * @brief      Reads a bitmap from a file
+ *
+ * @param      row          Row where to start reading data
+ * @param      amount       Amount of rows to read
+ */
+void Storage::readBitmap(uint16_t row, uint16_t amount)
+{
+    if (!readHeader())
+    {
+        Serial.println("Bitmap of unknown format! Unable to parse!");
+        return;
+    }
+
+    bitmap.width = this->header.width;
+    bitmap.height = this->header.height;
+    bitmap.first_row = row;
+    bitmap.rows = 0;
+    bitmap.runs = 0;
+
+    // Check if we know how to parse the format
+    bool const mono = this->header.bits_per_pixel == 1 && this->header.compression_method == 0;
+    bool const color = this->header.bits_per_pixel == 24 && this->header.compression_method == 0;
+    if (!mono && !color)
+    {
+        Serial.println("Bitmap of unknown format! Unable to parse!");
+        bitmap.type = BitmapType::error;
+        return;
+    }
+    // Serial.println("Monochrome or RGB888 BITMAPINFOHEADER bitmap identified");
+    bitmap.type = mono ? BitmapType::monochrome : BitmapType::rgb888;
+
+    // Check if encoded version already exists
+    char filename_original[30];
+    this->file.getName(filename_original, 30);
+
+    char filepath_encoded[50];
+    getEncodedPath(filename_original, filepath_encoded);
+
+    if (!SD.exists(filepath_encoded))
+    {
+        STAT_TIME_START(encode_started);
+        encodeBitmap(filename_original, filepath_encoded);
+        STAT_TIME(stat_encode, encode_started);
+    }
+
+    // Encoding uses the row buffer as well, so rows are read afterwards
+    // Color rows are only provided through the encoded file, already converted to RGB565
+    if (mono && row < this->header.height)
+    {
+        readMono40(row, min(amount, (uint16_t)(this->header.height - row)));
+    }
+}
+
+/**
+ * @brief      Reads the scanlines of an encoded bitmap covering a range of rows
+ *
+ * Scanlines are decoded into bitmap.scanlines, whatever the version of the file.
+ *
+ * @param      source       Encoded bitmap to read from
+ * @param      row          Row where to start reading data
+ * @param      amount       Amount of rows to read
+ */
+void Storage::readEncoded(EncodedSource const &source, uint16_t row, uint16_t amount)
+{
+    RunIterator runs;
+    this->bitmap.first_row = row;
+    this->bitmap.rows = amount;
+    this->bitmap.runs = 0;
+    if (!_openRuns(source, runs, row))
+    {
+        Serial.println("Encoded bitmap of unknown version!");
+        this->bitmap.type = BitmapType::error;
+        return;
+    }
+    this->bitmap.type = (runs.flags & CBM_FLAG_COLOR) ? BitmapType::rgb888_compressed : BitmapType::monochrome_compressed;
+    this->bitmap.width = runs.width > 0 ? runs.width : -1;
+    this->bitmap.height = runs.height;
+    if (amount == 0)
+    {
+        return;
+    }
+
+    // Count the scanlines first so that the row buffer is reserved only once
+    uint32_t const end_row = (uint32_t)row + amount;
+    RunIterator const start = runs;
+    uint32_t const position = _sourcePosition(runs.source);
+    uint16_t count = 0;
+    Scanline run;
+    while (count < UINT16_MAX / sizeof(Scanline) && _nextRun(runs, run) && run.row < end_row)
+    {
+        count++;
+    }
+    if (!reserveRowBuffer(count * sizeof(Scanline)))
+    {
+        return;
+    }
+
+    runs = start;
+    _sourceSeek(runs.source, position);
+    while (this->bitmap.runs < count && _nextRun(runs, this->bitmap.scanlines[this->bitmap.runs]))
+    {
+        this->bitmap.runs++;
+    }
+}
+
+/**
+ * @brief      Builds the path of the encoded version of a bitmap in /enc, created by Storage::updateEncodedIndex
+ *
+ * @param      filepath          Filepath of the original bitmap
+ * @param      filepath_encoded  Path of the encoded bitmap will be stored here, at least 50 bytes
+ */
+void Storage::getEncodedPath(char filepath[], char filepath_encoded[])
+{
+    // Only the filename without extension is used
+    char const *filename = strrchr(filepath, '/');
+    filename = filename ? filename + 1 : filepath;
+
+    char filename_encoded[30];
+    strncpy(filename_encoded, filename, 25);
+    filename_encoded[25] = '\0';
+    strtok(filename_encoded, ".");
+    strcat(filename_encoded, ".cbm");
+
+    strcpy(filepath_encoded, "/enc/");
+    strcat(filepath_encoded, filename_encoded);
+}
+
+/**
+ * @brief      Gets bitmap data from an image on the SD card.
+ *
+ * Bitmaps yield up to amount decoded rows, see Storage::readMono40. Encoded .cbm
+ * files yield their records for the rows. Rows are numbered in file order.
+ * The header stays parsed while the same file is read, so reading a bitmap
+ * in consecutive strips costs one seek per strip. Encoded bitmaps in the
+ * prefetch cache are decoded from memory without touching the SD card, as far
+ * as they are cached.
+ *
+ * @param      filepath   Filepath to read from.
+ * @param      row        Row where to start reading data
+ * @param      amount     Amount of rows to read, 0 to only read the dimensions
+ *
+ * @return     Bitmap containing the data or an empty struct if failed
+ */
+Bitmap const &Storage::getBitmap(char filepath[], uint16_t row, uint16_t amount)
+{
+    endRawWrite();
+    this->bitmap.rows = 0;
+    this->bitmap.runs = 0;
+    char const *extension = strrchr(filepath, '.');
+    bool const encoded = extension && strcasecmp(extension, ".cbm") == 0;
+    int8_t const cached = encoded ? findCacheEntry(filepath) : -1;
+    if (encoded)
+    {
+        STAT_COUNT(cached >= 0 ? stat_cache_hits : stat_cache_misses, 1);
+    }
+    if (cached >= 0 && this->cache_entries[cached].complete)
+    {
+        EncodedSource source;
+        readFromCache(source, cached);
+        readEncoded(source, row, amount);
+        return this->bitmap;
+    }
+
+    if (!openToRead(filepath))
+    {
+        this->bitmap.width = -1;
+        this->bitmap.height = -1;
+        this->bitmap.type = BitmapType::file_error;
+        return this->bitmap;
+    }
+
+    if (encoded)
+    {
+        EncodedSource source = _fileSource(this->file);
+        if (cached >= 0)
+        {
+            readFromCache(source, cached);
+        }
+        readEncoded(source, row, amount);
+        return this->bitmap;
+    }
+
+    readBitmap(row, amount);
+    return this->bitmap;
+}
+
+/**
+ * @brief      Opens the encoded version of a bitmap and starts decoding its scanlines
+ *
+ * Bitmaps are encoded first if that hasn't been done yet. Encoded bitmaps in
+ * the prefetch cache are decoded from memory, as far as they are cached.
+ *
+ * @param      filepath       Filepath of a bitmap or an encoded .cbm file
+ * @param      runs           Decoding state to initialize
+ * @param      row            First row to decode
+ * @param      overlay_block  Sector buffer to read through file_overlay with instead of file, null for file
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::openSpans(char filepath[], RunIterator &runs, uint16_t row, uint8_t overlay_block[])
+{
+    char filepath_encoded[50];
+    char const *extension = strrchr(filepath, '.');
+    if (!extension || strcasecmp(extension, ".cbm") != 0)
+    {
+        getEncodedPath(filepath, filepath_encoded);
+        if (!SD.exists(filepath_encoded))
+        {
+            // getBitmap automatically compresses if it is already not done
+            getBitmap(filepath, 0, 0);
+        }
+        filepath = filepath_encoded;
+    }
+
+    EncodedSource source;
+    int8_t const cached = findCacheEntry(filepath);
+    STAT_COUNT(cached >= 0 ? stat_cache_hits : stat_cache_misses, 1);
+    if (cached >= 0 && this->cache_entries[cached].complete)
+    {
+        readFromCache(source, cached);
+    }
+    else if (overlay_block)
+    {
+        this->file_overlay.close();
+        this->file_overlay = SD.open(filepath);
+        if (!this->file_overlay)
+        {
+            Serial.print("Failed to open file: ");
+            Serial.println(filepath);
+            return false;
+        }
+        source = _blockSource(this->file_overlay, overlay_block);
+    }
+    else if (openToRead(filepath))
+    {
+        source = _fileSource(this->file);
+    }
+    else
+    {
+        return false;
+    }
+    if (cached >= 0 && !this->cache_entries[cached].complete)
+    {
+        readFromCache(source, cached);
+    }
+
+    if (!_openRuns(source, runs, row))
+    {
+        Serial.println("Encoded bitmap of unknown version!");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief      Streams the scanlines of an encoded bitmap covering a range of rows
+ *
+ * Each scanline is handed to span as soon as it is decoded, so the bitmap can
+ * be drawn with line fills without the row buffer. Scanlines of monochrome
+ * bitmaps carry the color from Storage::fileGetMonoColor, in the same byte
+ * order as the colors of color bitmaps.
+ *
+ * @param      filepath  Filepath of a bitmap or an encoded .cbm file
+ * @param      span      Called with every scanline, in file order
+ * @param      row       Row where to start streaming
+ * @param      amount    Amount of rows to stream
+ *
+ * @return     Amount of scanlines streamed, -1 on failure
+ */
+int32_t Storage::streamSpans(char filepath[], StorageSpan span, uint16_t row, uint16_t amount)
+{
+    endRawWrite();
+    uint16_t const color = (this->mono_color << 8) | (this->mono_color >> 8);
+
+    RunIterator runs;
+    if (!openSpans(filepath, runs, row))
+    {
+        return -1;
+    }
+
+    uint32_t const end_row = (uint32_t)row + amount;
+    int32_t count = 0;
+    Scanline run;
+    while (_nextSpan(runs, run, end_row, color))
+    {
+        span(run);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief      Streams the scanlines of two encoded bitmaps drawn over each other
+ *
+ * Both bitmaps are decoded side by side in a single pass and their scanlines
+ * merged row by row, so every pixel is handed to span once. Where scanlines of
+ * both bitmaps cover the same pixels, those of the overlay win. Scanlines of
+ * a row are streamed in order of their start.
+ *
+ * @param      filepath          Filepath of the bitmap drawn below
+ * @param      filepath_overlay  Filepath of the bitmap drawn on top, empty if none
+ * @param      span              Called with every scanline
+ * @param      row               Row where to start streaming
+ * @param      amount            Amount of rows to stream
+ *
+ * @return     Amount of scanlines streamed, -1 on failure
+ */
+int32_t Storage::streamComposedSpans(char filepath[], char filepath_overlay[], StorageSpan span, uint16_t row, uint16_t amount)
+{
+    if (filepath_overlay == nullptr || filepath_overlay[0] == '\0')
+    {
+        return streamSpans(filepath, span, row, amount);
+    }
+    if (filepath[0] == '\0')
+    {
+        return streamSpans(filepath_overlay, span, row, amount);
+    }
+
+    endRawWrite();
+    uint16_t const color = (this->mono_color << 8) | (this->mono_color >> 8);
+
+    // The overlay is opened first, as encoding the other bitmap reuses file
+    // It is read through a sector of its own, as both files sharing the cache of the volume would reload it every switch
+    uint8_t overlay_block[STORAGE_SECTOR_SIZE];
+    RunIterator below;
+    RunIterator above;
+    if (!openSpans(filepath_overlay, above, row, overlay_block) || !openSpans(filepath, below, row))
+    {
+        this->file_overlay.close();
+        return -1;
+    }
+
+    uint32_t const end_row = (uint32_t)row + amount;
+    Scanline lower;
+    Scanline upper;
+    bool has_lower = _nextSpan(below, lower, end_row, color);
+    bool has_upper = _nextSpan(above, upper, end_row, color);
+    // Extent of the last scanline of the overlay streamed, hiding what lies below it
+    uint16_t covered_row = 0;
+    uint16_t covered_end = 0;
+    int32_t count = 0;
+    while (has_lower || has_upper)
+    {
+        if (has_lower && lower.row == covered_row && lower.start < covered_end)
+        {
+            lower.start = covered_end;
+            if (lower.start >= lower.end)
+            {
+                has_lower = _nextSpan(below, lower, end_row, color);
+                continue;
+            }
+        }
+
+        if (has_upper && (!has_lower || upper.row < lower.row || (upper.row == lower.row && upper.start <= lower.start)))
+        {
+            span(upper);
+            covered_row = upper.row;
+            covered_end = upper.end;
+            has_upper = _nextSpan(above, upper, end_row, color);
+        }
+        else if (has_upper && upper.row == lower.row && upper.start < lower.end)
+        {
+            // Stream the part up to the overlay, the rest is clipped once it has been streamed
+            Scanline part = lower;
+            part.end = upper.start;
+            span(part);
+            lower.start = upper.start;
+        }
+        else
+        {
+            span(lower);
+            has_lower = _nextSpan(below, lower, end_row, color);
+        }
+        count++;
+    }
+    this->file_overlay.close();
+    return count;
+}
+
+/**
+ * @brief      Streams the scanlines of both bitmaps mapped to a floor, see Storage::streamComposedSpans
+ *
+ * @param      floorNo  Floor number of the Mapping
+ * @param      span     Called with every scanline
+ * @param      row      Row where to start streaming
+ * @param      amount   Amount of rows to stream
+ *
+ * @return     Amount of scanlines streamed, -1 on failure
+ */
+int32_t Storage::streamFloorSpans(char floorNo[], StorageSpan span, uint16_t row, uint16_t amount)
+{
+    int const loc = findFromFloorNo(floorNo);
+    if (loc == -1)
+    {
+        Serial.print("Specified floor does not exist.\n");
+        return -1;
+    }
+    Mapping const &mapping = this->mappinglist.map_list[loc];
+    return streamComposedSpans((char *)getMappingName(mapping.bitmapName), (char *)getMappingName(mapping.bitmapName2), span, row, amount);
+}
+
+/**
+ * @brief      Opens a file for reading
+ *
+ * The file is read through a handle of its own, which Storage leaves alone until
+ * Storage::fileClose, so that a transfer can read it while bitmaps are being drawn.
+ *
+ * @param      filepath  Filepath of the file
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileOpenToRead(char filepath[])
+{
+    endRawWrite();
+    this->file_read.close();
+    this->file_read = SD.open(filepath);
+    if (!this->file_read)
+    {
+        Serial.print("Failed to open file: ");
+        Serial.println(filepath);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief      Opens a file for reading by Storage itself if it hasn't yet been opened
+ *
+ * @param      filepath  Filepath of the file
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::openToRead(char filepath[])
+{
+    endRawWrite();
+    char filepath_open[20];
+    this->file.getName(filepath_open, 20);
+
+    if (strcmp(filepath_open, filepath) == 0)
+    {
+        // Same file as previously
+        // Therefore, it should already be open
+        // Just seek to beginning because of new request to open
+        this->file.seek(0);
+        return true;
+    }
+
+    // Different file than previously
+    // Close previous one and open a new one
+    this->file.close();
+    this->header.valid = false;
+    this->file = SD.open(filepath);
+    if (!this->file)
+    {
+        Serial.print("Failed to open file: ");
+        Serial.println(filepath);
+        return false;
+    }
+    // Serial.print("Opening file: ");
+    // Serial.println(filepath);
+    return true;
+}
+
+/**
+ * @brief      Opens a file for writing
+ *
+ * Files are written through a handle of their own, which Storage leaves alone
+ * until Storage::fileClose, so a file can be read while another one is written.
+ *
+ * @param      filepath  Filepath of the file
+ * @param      overwrite Overwrite file if it exists
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileOpenToWrite(char filepath[], bool overwrite)
+{
+    // Close previous one and open a new one
+    endRawWrite();
+    this->file_write.close();
+    this->preallocated = 0;
+    this->file_write = openToWrite(filepath, overwrite);
+    if (!this->file_write)
+    {
+        Serial.print("Failed to open file: ");
+        Serial.println(filepath);
+        return false;
+    }
+    // Serial.print("Opening file: ");
+    // Serial.println(filepath);
+    return true;
+}
+
+/**
+ * @brief      Opens a file for writing, taking care of whatever refers to its previous content
+ *
+ * @param      filepath  Filepath of the file
+ * @param      overwrite Overwrite file if it exists
+ *
+ * @return     The open file, which is false if it could not be opened
+ */
+File Storage::openToWrite(char filepath[], bool overwrite)
+{
+    endRawWrite();
+    // New or rewritten encoded bitmaps change what can be browsed
+    if (strncmp(filepath, "/enc/", 5) == 0 || strncmp(filepath, "enc/", 4) == 0)
+    {
+        invalidateBrowseIndex();
+        invalidateCache();
+    }
+
+    if (SD.exists(filepath) && overwrite)
+    {
+        SD.remove(filepath);
+    }
+    invalidateIndexRecord(filepath);
+
+    // Don't keep reading a file that is being rewritten
+    char const *filename = strrchr(filepath, '/');
+    char filename_open[20];
+    this->file.getName(filename_open, 20);
+    if (strcmp(filename_open, filename ? filename + 1 : filepath) == 0)
+    {
+        closeRead();
+    }
+    return SD.open(filepath, FILE_WRITE);
+}
+
+/**
+ * @brief      Creates a file of a known size in one contiguous extent and opens it for writing
+ *
+ * Any existing file is replaced. Whole sectors written with Storage::fileWriteSectors
+ * then go straight to the card as one multi-block write, with no FAT updates until
+ * the file is closed. Anything else written, or any other file accessed, ends the
+ * multi-block write and the rest is written through the file as usual. A file closed
+ * before it was fully written is cut to what was written.
+ * Falls back to Storage::fileOpenToWrite if no contiguous extent is free.
+ *
+ * @param      filepath  Filepath of the file
+ * @param      size      Size of the file in bytes
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileOpenToWritePreallocated(char filepath[], uint32_t size)
+{
+    // Takes care of whatever refers to the file being replaced
+    if (!fileOpenToWrite(filepath, true) || size == 0)
+    {
+        return size == 0 && this->file_write;
+    }
+    this->file_write.close();
+    SD.remove(filepath);
+
+    uint32_t first_block;
+    uint32_t last_block;
+    if (!this->file_write.createContiguous(SD.vwd(), filepath, size) ||
+        !this->file_write.contiguousRange(&first_block, &last_block) ||
+        !SD.card()->writeStart(first_block, last_block - first_block + 1))
+    {
+        Serial.println("Failed to preallocate file, writing it as it grows");
+        this->file_write.close();
+        SD.remove(filepath);
+        return fileOpenToWrite(filepath, true);
+    }
+
+    this->raw_writing = true;
+    this->raw_start = first_block;
+    this->raw_block = first_block;
+    this->raw_end = last_block + 1;
+    this->preallocated = size;
+    return true;
+}
+
+/**
+ * @brief      Ends the multi-block write of a preallocated file, continuing through the file from where it left off
+ */
+void Storage::endRawWrite()
+{
+    if (!this->raw_writing)
+    {
+        return;
+    }
+
+    this->raw_writing = false;
+    SD.card()->writeStop();
+    this->file_write.seek((this->raw_block - this->raw_start) * STORAGE_SECTOR_SIZE);
+}
+
+/**
+ * @brief      Opens a partially written file to continue writing it
+ *
+ * The file is cut back to a multiple of alignment, dropping any incomplete block
+ * left behind by an interrupted write, and writing continues from there.
+ *
+ * @param      filepath   Filepath of the file, created if it doesn't exist
+ * @param      alignment  Size of the blocks the file is written in
+ *
+ * @return     Amount of bytes already in the file, -1 on failure
+ */
+int32_t Storage::fileOpenToResume(char filepath[], uint16_t alignment)
+{
+    if (!fileOpenToWrite(filepath, false))
+    {
+        return -1;
+    }
+
+    uint32_t const size = this->file_write.size() - this->file_write.size() % alignment;
+    if (!this->file_write.truncate(size) || !this->file_write.seek(size))
+    {
+        Serial.print("Failed to resume file: ");
+        Serial.println(filepath);
+        this->file_write.close();
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * @brief      Renames a file, replacing any file already at the new path
+ *
+ * @param      source  Filepath of the file
+ * @param      dest    New filepath of the file
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileRename(char source[], char dest[])
+{
+    // Renamed files might replace encoded bitmaps
+    if (strncmp(dest, "/enc/", 5) == 0 || strncmp(dest, "enc/", 4) == 0)
+    {
+        invalidateBrowseIndex();
+        invalidateCache();
+    }
+
+    // Files being read by Storage might be the ones renamed or replaced
+    endRawWrite();
+    closeRead();
+    if (SD.exists(dest))
+    {
+        SD.remove(dest);
+    }
+    invalidateIndexRecord(dest);
+    return SD.rename(source, dest);
+}
+
+/**
+ * @brief      Returns size of currently opened file
+ *
+ * @return     Amount of bytes available
+ */
+uint32_t Storage::fileSize()
+{
+    if (!this->file_read)
+    {
+        // Serial.println("No file was open for reporting size!");
+        return false;
+    }
+
+    return this->file_read.size();
+}
+
+/**
+ * @brief      Tells whether the file open for writing was preallocated, see Storage::fileOpenToWritePreallocated
+ *
+ * Writing a preallocated file never allocates clusters, so it doesn't stall for FAT updates.
+ *
+ * @return     True if preallocated, False otherwise
+ */
+bool Storage::fileIsPreallocated()
+{
+    return this->preallocated != 0;
+}
+
+/**
+ * @brief      Moves the read position of currently opened file
+ *
+ * @param      position  Offset from the start of the file
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileSeek(uint32_t position)
+{
+    if (!this->file_read)
+    {
+        return false;
+    }
+
+    STAT_COUNT(stat_sd_seeks, 1);
+    return this->file_read.seek(position);
+}
+
+/**
+ * @brief      Reads requested amount of data from a file
+ *
+ * @param      data    Buffer to read into
+ * @param      amount  Amount of bytes to read. Will read less if requested amount not available.
+ *
+ * @return     Amount of bytes read, -1 on failure.
+ */
+int32_t Storage::fileReadData(uint8_t data[], uint16_t amount)
+{
+    if (!this->file_read)
+    {
+        // Serial.println("No file was open for reading!");
+        return -1;
+    }
+
+    // Reading a preallocated file being written would interrupt its multi-block write
+    endRawWrite();
+    uint32_t available = this->file_read.available();
+    STAT_COUNT(stat_sd_reads, 1);
+    STAT_COUNT(stat_sd_read_bytes, min((uint32_t)amount, available));
+    if (amount > available)
+    {
+        // Not enough data left on file
+        return this->file_read.read(data, available);
+    }
+
+    // Read normally
+    return this->file_read.read(data, amount);
+}
+
+/**
+ * @brief      Writes data into a file
+ *
+ * @param      data    Array of data to write
+ * @param      amount  Amount of bytes to write
+ *
+ * @return     Amount of bytes written, -1 on failure.
+ */
+int32_t Storage::fileWriteData(uint8_t data[], uint16_t amount)
+{
+    if (!this->file_write)
+    {
+        // Serial.println("No file was open for writing!");
+        return -1;
+    }
+
+    endRawWrite();
+    STAT_COUNT(stat_sd_writes, 1);
+    STAT_COUNT(stat_sd_write_bytes, amount);
+    return this->file_write.write(data, amount);
+}
+
+/**
+ * @brief      Writes whole sectors into a file, bypassing the sector cache
+ *
+ * SdFat writes full blocks starting on a block boundary directly to the card
+ * instead of staging them in its single-sector cache. Writes from a position that
+ * is not sector aligned still succeed but go through the cache.
+ *
+ * @param      data    Array of data to write, count * STORAGE_SECTOR_SIZE bytes
+ * @param      count   Amount of sectors to write
+ *
+ * @return     Amount of bytes written, -1 on failure.
+ */
+int32_t Storage::fileWriteSectors(uint8_t data[], uint16_t count)
+{
+    if (!this->file_write)
+    {
+        // Serial.println("No file was open for writing!");
+        return -1;
+    }
+
+    if (this->file_write.position() % STORAGE_SECTOR_SIZE != 0)
+    {
+        Serial.println("Sector write is not aligned!");
+    }
+
+    STAT_COUNT(stat_sd_writes, 1);
+    STAT_COUNT(stat_sd_write_bytes, (uint32_t)count * STORAGE_SECTOR_SIZE);
+
+    // Sectors of a preallocated file go straight to the card while they fit
+    if (this->raw_writing && this->raw_block + count <= this->raw_end)
+    {
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            if (!SD.card()->writeData(data + (uint32_t)i * STORAGE_SECTOR_SIZE))
+            {
+                Serial.println("Failed to write sector!");
+                endRawWrite();
+                return i * STORAGE_SECTOR_SIZE;
+            }
+            this->raw_block++;
+        }
+        return (uint32_t)count * STORAGE_SECTOR_SIZE;
+    }
+    endRawWrite();
+
+    return this->file_write.write(data, (uint32_t)count * STORAGE_SECTOR_SIZE);
+}
+
+/**
+ * @brief      Closes the files opened by Storage::fileOpenToRead and Storage::fileOpenToWrite
+ *
+ * @return     True on success, False if no file was open
+ */
+bool Storage::fileClose()
+{
+    // This method is not needed per se as the file is closed anyways when opening a new one
+    // However, this is more secure in case of failures before opening another file etc.
+    if (!this->file_read && !this->file_write)
+    {
+        // Serial.println("No file was open for closing!");
+        return false;
+    }
+
+    // Don't leave unwritten space of a preallocated file behind
+    endRawWrite();
+    if (this->preallocated && this->file_write.position() < this->preallocated)
+    {
+        this->file_write.truncate(this->file_write.position());
+    }
+    this->preallocated = 0;
+
+    this->file_read.close();
+    this->file_write.close();
+    return true;
+}
+
+/**
+ * @brief      Closes the file Storage reads bitmaps and its own files through
+ */
+void Storage::closeRead()
+{
+    this->file.close();
+    this->header.valid = false;
+}
+
+/**
+ * @brief      Copies a file from one location to another
+ *
+ * Both files are opened once and streamed through a sector sized buffer, so that
+ * full sectors bypass the sector cache. The files of Storage::fileOpenToRead and
+ * Storage::fileOpenToWrite are left open.
+ *
+ * @param      source     The source filepath
+ * @param      dest       The destination filepath
+ * @param      overwrite  Overwrite existing file
+ * @param      progress   Called after every sector with the bytes copied so far and the total, may be null
+ *
+ * @return     True on success, False otherwise
+ */
+bool Storage::fileCopy(char source[], char dest[], bool overwrite, StorageProgress progress)
+{
+    if (_samePath(source, dest) || (SD.exists(dest) && !overwrite))
+    {
+        // Can't overwrite existing, least of all the source itself
+        return false;
+    }
+
+    // Opening the destination closes a file of the same name being read, even in another directory
+    File dest_file = openToWrite(dest, true);
+    File source_file = SD.open(source);
+    if (!dest_file || !source_file)
+    {
+        // Failed to open either file
+        dest_file.close();
+        source_file.close();
+        return false;
+    }
+
+    uint8_t buffer[STORAGE_SECTOR_SIZE];
+    uint32_t const file_size = source_file.size();
+    uint32_t copied = 0;
+    bool success = true;
+    while (copied < file_size && success)
+    {
+        int const read_amount = source_file.read(buffer, STORAGE_SECTOR_SIZE);
+        success = read_amount > 0 && dest_file.write(buffer, read_amount) == (size_t)read_amount;
+        copied += max(read_amount, 0);
+
+        if (progress)
+        {
+            progress(copied, file_size);
+        }
+    }
+    source_file.close();
+    dest_file.close();
+    return success;
+}
+
+/**
+ * @brief      Builds the index of encoded bitmaps used for browsing, unless already done
+ *
+ * Only directory entry indices are kept, so any file can be opened directly by position.
+ */
+void Storage::buildBrowseIndex()
+{
+    if (this->browse_valid)
+    {
+        return;
+    }
+
+    endRawWrite();
+    this->browse_count = 0;
+    this->browse_position = 0;
+    File root = SD.open("/enc");
+    File entry = root.openNextFile();
+    while (entry)
+    {
+        if (!entry.isDirectory())
+        {
+            if (this->browse_count == STORAGE_BROWSE_CAPACITY)
+            {
+                Serial.println("Too many encoded bitmaps to browse!");
+                break;
+            }
+            this->browse_index[this->browse_count++] = entry.dirIndex();
+        }
+        entry = root.openNextFile();
+    }
+    entry.close();
+    root.close();
+    this->browse_valid = true;
+}
+
+/**
+ * @brief      Marks the browsing index outdated after the contents of /enc have changed
+ */
+void Storage::invalidateBrowseIndex()
+{
+    this->browse_valid = false;
+}
+
+/**
+ * @brief      Finds the browsing position of an encoded bitmap
+ *
+ * The position last browsed to is checked first, so stepping through the
+ * files doesn't require searching.
+ *
+ * @param      filename  Filename of the file
+ *
+ * @return     Position of the file, -1 if not found
+ */
+int32_t Storage::findBrowsePosition(char filename[])
+{
+    buildBrowseIndex();
+
+    char filename_entry[30];
+    uint16_t const browsed = this->browse_position;
+    for (uint16_t i = 0; i < this->browse_count; ++i)
     {
-        SD.remove(filepath);
+        uint16_t const position = (browsed + i) % this->browse_count;
+        File entry = fileGetAt(position);
+        entry.getName(filename_entry, 30);
+        entry.close();
+        if (strcmp(filename, filename_entry) == 0)
+        {
+            return position;
+        }
     }
+    return -1;
+}
 
-    // Close previous one and open a new one
-    this->file.close();
-    this->file = SD.open(filepath, FILE_WRITE);
-    if (!this->file)
+/**
+ * @brief      Returns the amount of encoded bitmaps available for browsing
+ *
+ * @return     Amount of files
+ */
+uint16_t Storage::fileCount()
+{
+    buildBrowseIndex();
+    return this->browse_count;
+}
+
+/**
+ * @brief      Gets an encoded bitmap by its browsing position
+ *
+ * @param      position  Position of the file, 0 to fileCount() - 1
+ *
+ * @return     The file, or a closed file if out of range
+ */
+File Storage::fileGetAt(uint16_t position)
+{
+    buildBrowseIndex();
+
+    File entry;
+    if (position >= this->browse_count)
     {
-        Serial.print("Failed to open file: ");
+        return entry;
+    }
+
+    File root = SD.open("/enc");
+    entry.open(&root, this->browse_index[position], O_READ);
+    root.close();
+    this->browse_position = position;
+    return entry;
+}
+
+/**
+ * @brief      Gets the previous file in the filesystem
+ *
+ * Wraps around to the last file, also if the current file is unknown.
+ *
+ * @param      filename_current  Filename of the current file
+ *
+ * @return     The previous file
+ */
+File Storage::fileGetPrevious(char filename_current[])
+{
+    int32_t position = findBrowsePosition(filename_current);
+    if (position < 0)
+    {
+        position = 0;
+    }
+    uint16_t const count = fileCount();
+    return fileGetAt((position + count - 1) % max(count, 1));
+}
+
+/**
+ * @brief      Gets the next file in the filesystem
+ *
+ * Wraps around to the first file, also if the current file is unknown.
+ *
+ * @param      filename_current  Filename of the current file, the filename of the next file will be stored here
+ *
+ * @return     The next file
+ */
+File Storage::fileGetNext(char filename_current[])
+{
+    int32_t position = findBrowsePosition(filename_current);
+    uint16_t const count = fileCount();
+    File entry = fileGetAt((position + 1) % max(count, 1));
+    if (entry)
+    {
+        entry.getName(filename_current, 30);
+    }
+    return entry;
+}
+
+/**
+ * @brief      Finds an encoded bitmap in the prefetch cache and marks it used
+ *
+ * @param      filepath  Filepath of the encoded bitmap
+ *
+ * @return     Index of the cache entry, -1 if not cached
+ */
+int8_t Storage::findCacheEntry(char const filepath[])
+{
+    for (uint8_t i = 0; i < STORAGE_CACHE_SLOTS; ++i)
+    {
+        if (this->cache_entries[i].filepath[0] != '\0' && strcmp(this->cache_entries[i].filepath, filepath) == 0)
+        {
+            this->cache_entries[i].used = ++this->cache_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief      Reads the part of an encoded bitmap held by the prefetch cache from memory
+ *
+ * @param      source  Source to read from, also reading the rest from its file if only part is cached
+ * @param      cached  Index of the cache entry
+ */
+void Storage::readFromCache(EncodedSource &source, int8_t cached)
+{
+    CacheEntry const &entry = this->cache_entries[cached];
+    source.data = this->cache_data + entry.offset;
+    if (entry.complete)
+        source.size = entry.size;
+    else
+        source.prefix = entry.size;
+}
+
+/**
+ * @brief      Moves all encoded bitmaps in the prefetch cache to its start, in their current order
+ *
+ * @return     Amount of bytes used
+ */
+uint16_t Storage::compactCache()
+{
+    uint16_t used = 0;
+    bool moved[STORAGE_CACHE_SLOTS] = { false };
+    for (uint8_t n = 0; n < STORAGE_CACHE_SLOTS; ++n)
+    {
+        // Move the entry closest to the start next, so nothing is overwritten
+        int8_t next = -1;
+        for (uint8_t i = 0; i < STORAGE_CACHE_SLOTS; ++i)
+        {
+            CacheEntry const &entry = this->cache_entries[i];
+            if (!moved[i] && entry.filepath[0] != '\0' && (next < 0 || entry.offset < this->cache_entries[next].offset))
+                next = i;
+        }
+        if (next < 0)
+        {
+            break;
+        }
+
+        CacheEntry &entry = this->cache_entries[next];
+        memmove(this->cache_data + used, this->cache_data + entry.offset, entry.size);
+        entry.offset = used;
+        used += entry.size;
+        moved[next] = true;
+    }
+    return used;
+}
+
+/**
+ * @brief      Loads an encoded bitmap into the prefetch cache, evicting the least recently used ones
+ *
+ * getBitmap decodes cached bitmaps from memory. Bitmaps are kept encoded, being
+ * several times smaller than their decoded scanlines. Of bitmaps larger than the
+ * cache only the first STORAGE_CACHE_STRIP bytes are cached, holding the rows at
+ * their top which are drawn first, and the rest is still read from the SD card.
+ *
+ * @param      filepath  Filepath of the encoded bitmap
+ *
+ * @return     True if the bitmap is cached, whole or in part, False if it was refused
+ */
+bool Storage::prefetchBitmap(char filepath[])
+{
+    if (findCacheEntry(filepath) >= 0)
+    {
+        return true;
+    }
+    endRawWrite();
+
+    File encoded = SD.open(filepath);
+    if (!encoded || strlen(filepath) >= sizeof(CacheEntry::filepath))
+    {
+        encoded.close();
+        Serial.print("Failed to prefetch bitmap: ");
         Serial.println(filepath);
         return false;
     }
-    // Serial.print("Opening file: ");
-    // Serial.println(filepath);
+    uint32_t const file_size = encoded.size();
+    uint16_t const size = file_size > STORAGE_CACHE_SIZE ? STORAGE_CACHE_STRIP : file_size;
+
+    // Evict until both an entry and enough space are free
+    int8_t slot;
+    uint16_t used;
+    while (true)
+    {
+        slot = -1;
+        used = 0;
+        int8_t oldest = -1;
+        for (uint8_t i = 0; i < STORAGE_CACHE_SLOTS; ++i)
+        {
+            CacheEntry const &entry = this->cache_entries[i];
+            if (entry.filepath[0] == '\0')
+            {
+                slot = i;
+                continue;
+            }
+            used += entry.size;
+            if (oldest < 0 || (uint16_t)(this->cache_clock - entry.used) > (uint16_t)(this->cache_clock - this->cache_entries[oldest].used))
+                oldest = i;
+        }
+        if (slot >= 0 && used + size <= STORAGE_CACHE_SIZE)
+        {
+            break;
+        }
+        this->cache_entries[oldest].filepath[0] = '\0';
+    }
+
+    CacheEntry &entry = this->cache_entries[slot];
+    entry.offset = compactCache();
+    entry.size = size;
+    entry.complete = size == file_size;
+    bool const success = encoded.read(this->cache_data + entry.offset, size) == (int32_t)size;
+    encoded.close();
+    if (!success)
+    {
+        Serial.print("Failed to prefetch bitmap: ");
+        Serial.println(filepath);
+        return false;
+    }
+    strcpy(entry.filepath, filepath);
+    entry.used = ++this->cache_clock;
     return true;
 }
 
 /**
- * @brief      Returns size of currently opened file
+ * @brief      Prefetches the bitmaps of the floors ahead in the direction of travel
  *
- * @return     Amount of bytes available
+ * Floors are ordered by their number, floors that aren't numbers are never
+ * predicted and count as floor 0 when departing from them. The nearest floors
+ * are fetched last, so they are the last to be evicted.
+ *
+ * @param      floorNo    Char array specifying floorNo currently departed from
+ * @param      direction  Greater than 0 when travelling up, less than 0 down, 0 when stopped
  */
-uint32_t Storage::fileSize()
+void Storage::hintTravel(char floorNo[], int8_t direction)
 {
-    if (!this->file)
+    int loc = findFromFloorNo(floorNo);
+    if (direction == 0 || loc == -1)
     {
-        // Serial.println("No file was open for reporting size!");
-        return false;
+        return;
+    }
+
+    // Numeric floors have keys above -1000
+    int16_t key = this->mappinglist.map_list[loc].floorKey;
+    if (key < -999)
+    {
+        key = 0;
+    }
+
+    int16_t upcoming[STORAGE_PREFETCH_FLOORS];
+    uint8_t count = 0;
+    while (count < STORAGE_PREFETCH_FLOORS)
+    {
+        int16_t next = -1;
+        for (uint16_t ctr = 0; ctr < this->mappinglist.n_floors; ctr++)
+        {
+            int16_t const candidate = this->mappinglist.map_list[ctr].floorKey;
+            int16_t const best = (next < 0) ? 0 : this->mappinglist.map_list[next].floorKey;
+            if (candidate >= -999 && (direction > 0 ? candidate > key : candidate < key) &&
+                (next < 0 || (direction > 0 ? candidate < best : candidate > best)))
+                next = ctr;
+        }
+        if (next < 0)
+        {
+            break;
+        }
+        upcoming[count++] = next;
+        key = this->mappinglist.map_list[next].floorKey;
+    }
+
+    while (count-- > 0)
+    {
+        Mapping const &mapping = this->mappinglist.map_list[upcoming[count]];
+        uint16_t const names[2] = { mapping.bitmapName, mapping.bitmapName2 };
+        for (uint8_t i = 0; i < 2; ++i)
+        {
+            if (names[i] != 0)
+            {
+                char filepath[50];
+                getEncodedPath((char *)getMappingName(names[i]), filepath);
+                prefetchBitmap(filepath);
+            }
+        }
     }
+}
 
-    return this->file.size();
+/**
+ * @brief      Drops all encoded bitmaps from the prefetch cache after encoded bitmaps have changed
+ */
+void Storage::invalidateCache()
+{
+    for (uint8_t i = 0; i < STORAGE_CACHE_SLOTS; ++i)
+    {
+        this->cache_entries[i].filepath[0] = '\0';
+    }
 }
 
 /**
- * @brief      Reads requested amount of data from a file
+ * @brief      Gets mono_color as loaded from SD card at start and saved since
  *
- * @param      data    Buffer to read into
- * @param      amount  Amount of bytes to read. Will read less if requested amount not available.
+ * @return     Value of Display::mono_color
+ */
+uint16_t Storage::fileGetMonoColor()
+{
+    return this->mono_color;
+}
+
+/**
+ * @brief      Saves the color used by the Display
  *
- * @return     Amount of bytes read, -1 on failure.
+ * @param      mono_color  Color to save
  */
-int32_t Storage::fileReadData(uint8_t data[], uint16_t amount)
+void Storage::fileSaveMonoColor(uint16_t mono_color)
 {
-    if (!this->file)
+    char filename[20] = "monocolor";
+    File mono = openToWrite(filename, true);
+    if (!mono || mono.write((uint8_t *)&mono_color, 2) != 2)
     {
-        // Serial.println("No file was open for reading!");
+        Serial.println("Failed to save color!");
+    }
+    mono.close();
+    this->mono_color = mono_color;
+}
+
+/**
+* @brief      Converts a floor number into a key independent of its formatting
+*
+* Numeric floors map to their value, so "01" and "1" are the same floor. Any other
+* floor maps to a case-insensitive hash outside the numeric range.
+*
+* @param      floorNo  Char array specifying floorNo
+*
+* @return     Key of the floor
+*/
+static int16_t _floorKey(char const floorNo[])
+{
+    char const *digits = (floorNo[0] == '-') ? floorNo + 1 : floorNo;
+    bool numeric = digits[0] != '\0';
+    int16_t value = 0;
+    for (char const *c = digits; *c != '\0' && numeric; ++c)
+    {
+        numeric = *c >= '0' && *c <= '9' && value < 1000;
+        value = value * 10 + (*c - '0');
+    }
+    if (numeric)
+    {
+        return (floorNo[0] == '-') ? -value : value;
+    }
+
+    // FNV-1a, placed below the most negative numeric floor
+    uint16_t hash = 0x9DC5;
+    for (char const *c = floorNo; *c != '\0'; ++c)
+        hash = (hash ^ (uint8_t)toupper(*c)) * 0x0193;
+    return (int16_t)(0x8000 | (hash & 0x3FFF));
+}
+
+/**
+* @brief      Hashes a floor key into a slot of the floor lookup table
+*
+* @param      key  Key of the floor
+* @param      slots  Amount of slots in the table
+*
+* @return     Slot to start probing from
+*/
+static inline uint16_t _floorSlot(int16_t key, uint16_t slots)
+{
+    return ((uint16_t)key * 40503u >> 8) % slots;
+}
+
+/**
+* @brief      Hashes a pair of bitmap names into a slot of the bitmap lookup table
+*
+* @param      bitmapName  First bitmap name
+* @param      bitmapName2  Second bitmap name
+* @param      slots  Amount of slots in the table
+*
+* @return     Slot to start probing from
+*/
+static uint16_t _bitmapSlot(char const bitmapName[], char const bitmapName2[], uint16_t slots)
+{
+    // FNV-1a over both names, separated by a comma as in the text format
+    uint16_t hash = 0x9DC5;
+    for (char const *c = bitmapName; *c != '\0'; ++c)
+        hash = (hash ^ (uint8_t)*c) * 0x0193;
+    hash = (hash ^ ',') * 0x0193;
+    for (char const *c = bitmapName2; *c != '\0'; ++c)
+        hash = (hash ^ (uint8_t)*c) * 0x0193;
+    return hash % slots;
+}
+
+/**
+* @brief      Allocates the arena holding the MappingList structure, its lookup tables and names
+*
+* Any previous mappings are dropped. All mappings start out with empty names.
+*
+* @param      floors  Amount of mappings
+* @param      pool_size  Bytes to reserve for names
+*
+* @return     0 if successful, -1 otherwise
+*/
+int Storage::allocateMappingList(uint16_t floors, uint16_t pool_size)
+{
+    delete[] this->mapping_arena;
+
+    uint16_t const slots = max(2 * floors, 1);
+    pool_size = max(pool_size, 1);
+    this->mapping_arena = new uint8_t [floors * sizeof(Mapping) + 2 * slots * sizeof(int16_t) + pool_size];
+    if (!this->mapping_arena)
+    {
+        Serial.println("Failed to allocate MappingList!");
+        // Leave an empty list that needs no arena
+        static int16_t empty_slots[2];
+        static char empty_pool[1];
+        this->mappinglist.map_list = nullptr;
+        this->floor_slots = empty_slots;
+        this->bitmap_slots = empty_slots + 1;
+        this->floor_slot_count = 1;
+        this->mappinglist.pool = empty_pool;
+        this->mappinglist.pool_size = 1;
+        this->mappinglist.pool[0] = '\0';
+        this->mappinglist.pool_used = 1;
+        this->mappinglist.n_floors = 0;
+        this->mappinglist.n_mapped_floors = 0;
+        this->pool_committed = 0;
+        this->pool_compacted = true;
+        buildFloorIndex();
         return -1;
     }
 
-    uint32_t available = this->file.available();
-    if (amount > available)
+    this->mappinglist.map_list = (Mapping *)this->mapping_arena;
+    this->floor_slots = (int16_t *)(this->mappinglist.map_list + floors);
+    this->bitmap_slots = this->floor_slots + slots;
+    this->floor_slot_count = slots;
+    this->mappinglist.pool = (char *)(this->bitmap_slots + slots);
+    this->mappinglist.pool_size = pool_size;
+    // Offset 0 is always the empty name
+    this->mappinglist.pool[0] = '\0';
+    this->mappinglist.pool_used = 1;
+    this->mappinglist.n_floors = floors;
+    this->mappinglist.n_mapped_floors = 0;
+    memset(this->mappinglist.map_list, 0, floors * sizeof(Mapping));
+    this->pool_committed = 0;
+    this->pool_compacted = true;
+    buildFloorIndex();
+    return 0;
+}
+
+/**
+* @brief      Stores a name into the string pool, unless already there
+*
+* A full pool is compacted into a new arena with room for the name. Only names
+* referred to by mappings survive compaction, so offsets not stored in a mapping
+* yet are lost by interning another name.
+*
+* @param      name  Name to store
+*
+* @return     Offset of the name in the pool, 0 if it could not be stored
+*/
+uint16_t Storage::internName(char const name[])
+{
+    if (name[0] == '\0')
+    {
+        return 0;
+    }
+
+    for (uint16_t offset = 1; offset < this->mappinglist.pool_used; offset += strlen(this->mappinglist.pool + offset) + 1)
+    {
+        if (strcmp(this->mappinglist.pool + offset, name) == 0)
+        {
+            return offset;
+        }
+    }
+
+    uint16_t const length = strlen(name) + 1;
+    if (this->mappinglist.pool_used + length > this->mappinglist.pool_size)
+    {
+        // Move everything into a new arena, only keeping names still in use
+        uint8_t *old_arena = this->mapping_arena;
+        MappingList const old_list = this->mappinglist;
+        int16_t *old_floor_slots = this->floor_slots;
+        int16_t *old_bitmap_slots = this->bitmap_slots;
+        uint16_t const old_slot_count = this->floor_slot_count;
+        uint16_t const old_committed = this->pool_committed;
+        bool const old_compacted = this->pool_compacted;
+        this->mapping_arena = nullptr;
+        if (allocateMappingList(old_list.n_floors, old_list.pool_used + length + STORAGE_POOL_SLACK) != 0)
+        {
+            // The old arena still holds the list along with its lookup tables
+            this->mapping_arena = old_arena;
+            this->mappinglist = old_list;
+            this->floor_slots = old_floor_slots;
+            this->bitmap_slots = old_bitmap_slots;
+            this->floor_slot_count = old_slot_count;
+            this->pool_committed = old_committed;
+            this->pool_compacted = old_compacted;
+            return 0;
+        }
+        for (uint16_t ctr = 0; ctr < old_list.n_floors; ctr++)
+        {
+            Mapping &mapping = this->mappinglist.map_list[ctr];
+            mapping.floorKey = old_list.map_list[ctr].floorKey;
+            mapping.floorNo = internName(old_list.pool + old_list.map_list[ctr].floorNo);
+            mapping.bitmapName = internName(old_list.pool + old_list.map_list[ctr].bitmapName);
+            mapping.bitmapName2 = internName(old_list.pool + old_list.map_list[ctr].bitmapName2);
+        }
+        uint16_t const offset = internName(name);
+        delete[] old_arena;
+        buildFloorIndex();
+        return offset;
+    }
+
+    strcpy(this->mappinglist.pool + this->mappinglist.pool_used, name);
+    this->mappinglist.pool_used += length;
+    return this->mappinglist.pool_used - length;
+}
+
+/**
+* @brief      Gets a name of a mapping from the string pool
+*
+* @param      offset  Offset of the name, as stored in Mapping
+*
+* @return     Zero-terminated name
+*/
+char const *Storage::getMappingName(uint16_t offset)
+{
+    return this->mappinglist.pool + offset;
+}
+
+/**
+* @brief      Calculates a hash of a single Mapping, used to find the mappings that differ between nodes
+*
+* The hash covers the floor number and both bitmap names, not their offsets in the
+* string pool, so equal mappings hash the same on any node.
+*
+* @param      index  Index of the Mapping in the MappingList structure
+*
+* @return     CRC16 of the mapping, 0 if the index is out of range
+*/
+uint16_t Storage::getMappingHash(uint16_t index)
+{
+    if (index >= this->mappinglist.n_floors)
+    {
+        return 0;
+    }
+
+    Mapping const &mapping = this->mappinglist.map_list[index];
+    char const * const names[3] = { getMappingName(mapping.floorNo), getMappingName(mapping.bitmapName), getMappingName(mapping.bitmapName2) };
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < 3; ++i)
     {
-        // Not enough data left on file
-        this->file.read(data, available);
-        return available;
+        // Terminators are included so that names can't shift into each other
+        crc = crc16((uint8_t const *)names[i], strlen(names[i]) + 1, crc);
     }
-
-    // Read normally
-    this->file.read(data, amount);
-    return amount;
+    return crc;
 }
 
 /**
- * @brief      Writes data into a file
- *
- * @param      data    Array of data to write
- * @param      amount  Amount of bytes to write
- *
- * @return     Amount of bytes written, -1 on failure.
- */
-int32_t Storage::fileWriteData(uint8_t data[], uint16_t amount)
+* @brief      Fills in the header of a binary mapping file for the current MappingList
+*
+* @param      header  Header to fill in
+*/
+void Storage::fillMappingHeader(MappingHeader &header)
 {
-    if (!this->file)
+    header.magic[0] = 'M';
+    header.magic[1] = 'L';
+    header.version = MAPPING_FILE_VERSION;
+    header.reserved = 0;
+    header.n_records = this->mappinglist.n_floors;
+    header.pool_size = this->mappinglist.pool_used;
+
+    // Count floors that have any bitmap mapped
+    header.n_mapped_floors = 0;
+    for (uint16_t ctr = 0; ctr < this->mappinglist.n_floors; ctr++)
     {
-        // Serial.println("No file was open for writing!");
-        return -1;
+        if (this->mappinglist.map_list[ctr].bitmapName != 0 || this->mappinglist.map_list[ctr].bitmapName2 != 0)
+            header.n_mapped_floors++;
     }
-
-    return this->file.write(data, amount);
+    this->mappinglist.n_mapped_floors = header.n_mapped_floors;
+    header.crc = crc16((uint8_t *)this->mappinglist.map_list, this->mappinglist.n_floors * sizeof(Mapping));
+    header.crc = crc16((uint8_t *)this->mappinglist.pool, this->mappinglist.pool_used, header.crc);
 }
 
 /**
- * @brief      Closes the file handle after writing has finished
- *
- * @return     True on success, False otherwise
- */
-bool Storage::fileClose()
+* @brief      Reads one line of a mapping in text format from the currently open file
+*
+* @param      line  Buffer of STORAGE_MAPPING_LINE bytes to read into, longer lines are cut
+*
+* @return     False at the end of the mapping, True otherwise
+*/
+bool Storage::readMappingLine(char line[])
 {
-    // This method is not needed per se as the file is closed anyways when opening a new one
-    // However, this is more secure in case of failures before opening another file etc.
-    if (!this->file)
+    uint16_t length = 0;
+    int c = this->file.read();
+    if (c < 0 || c == '$') //indicates EOF
     {
-        // Serial.println("No file was open for closing!");
         return false;
     }
 
-    this->file.close();
+    while (c >= 0 && c != '\n')
+    {
+        if (c != '\r' && length < STORAGE_MAPPING_LINE - 1)
+            line[length++] = c;
+        c = this->file.read();
+    }
+    line[length] = '\0';
     return true;
 }
 
 /**
- * @brief      Copies a file from one location to another
- *
- * @param      source     The source filepath
- * @param      dest       The destination filepath
- * @param      overwrite  Overwrite existing file
- *
- * @return     True on success, False otherwise
- */
-bool Storage::fileCopy(char source[], char dest[], bool overwrite)
+* @brief      Parses a mapping in text format from the currently open file into the MappingList structure
+*
+* The file is read twice, first to size the arena exactly and then to fill it.
+*/
+void Storage::parseMappingText()
 {
-    if (SD.exists(dest))
+    char line[STORAGE_MAPPING_LINE];
+
+    // Every name takes at most as much space as its text including the separators
+    uint16_t floors = 0;
+    uint16_t pool_size = 1;
+    this->file.seek(0);
+    while (readMappingLine(line))
     {
-        if (overwrite)
-        {
-            SD.remove(dest);
-        }
-        else
+        floors++;
+        pool_size += strlen(line) + 1;
+    }
+    if (allocateMappingList(floors, pool_size + STORAGE_POOL_SLACK) != 0)
+    {
+        return;
+    }
+
+    this->file.seek(0);
+    uint16_t mapped_floor_count = 0;
+    for (uint16_t list_itr = 0; list_itr < floors && readMappingLine(line); list_itr++)
+    {
+        // Fields are separated by commas: floor number, first bitmap name, second bitmap name
+        char *bmp_name = strchr(line, ',');
+        char *bmp_name2 = bmp_name ? strchr(bmp_name + 1, ',') : nullptr;
+        if (bmp_name)
+            *bmp_name++ = '\0';
+        if (bmp_name2)
+            *bmp_name2++ = '\0';
+
+        Mapping &mapping = this->mappinglist.map_list[list_itr];
+        mapping.floorNo = internName(line);
+        mapping.floorKey = _floorKey(line);
+        mapping.bitmapName = internName(bmp_name ? bmp_name : "");
+        mapping.bitmapName2 = internName(bmp_name2 ? bmp_name2 : "");
+        if (mapping.bitmapName != 0 || mapping.bitmapName2 != 0)
+            mapped_floor_count++;
+    }
+
+    this->mappinglist.n_mapped_floors = mapped_floor_count;
+}
+
+/**
+* @brief      Converts a binary mapping file of MAPPING_FILE_VERSION_FIXED from the currently open file
+*
+* The records are read twice, first to check them and size the arena and then to
+* intern their names. The list is left as compacted, so that the next commit writes
+* the file in the current version.
+*
+* @param      header  Header already read from the file
+*
+* @return     True if successful, False if the file is corrupted or the list could not be allocated
+*/
+bool Storage::parseMappingFixed(MappingHeaderFixed const &header)
+{
+    MappingFixed record;
+    uint16_t crc = 0xFFFF;
+    uint16_t pool_size = 1;
+    for (uint16_t ctr = 0; ctr < header.n_records; ctr++)
+    {
+        if (this->file.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
         {
-            // Can't overwrite existing
             return false;
         }
+        crc = crc16((uint8_t *)&record, sizeof(record), crc);
+        pool_size += sizeof(record) + 3;
     }
-
-    if (!fileOpenToRead(source))
+    if (crc != header.crc || allocateMappingList(header.n_records, pool_size + STORAGE_POOL_SLACK) != 0)
     {
-        // Failed to open source file
         return false;
     }
 
-    // Copy file using a buffer
-    uint16_t buffer_len = 64;
-    uint8_t buffer[buffer_len];
-    int16_t file_size = this->file.available();
-    for (int16_t i = 0; i * buffer_len < file_size; ++i)
+    this->file.seek(sizeof(header));
+    for (uint16_t ctr = 0; ctr < header.n_records; ctr++)
     {
-        fileOpenToRead(source);
-        this->file.seek(i * buffer_len);
-        uint16_t read_amount = fileReadData(buffer, buffer_len);
-        fileOpenToWrite(dest, false);
-        fileWriteData(buffer, read_amount);
+        this->file.read((uint8_t *)&record, sizeof(record));
+        // Names filling their field have no terminator
+        char floor_no[sizeof(record.floorNo) + 1] = { 0 };
+        char bitmap_name[sizeof(record.bitmapName) + 1] = { 0 };
+        char bitmap_name2[sizeof(record.bitmapName2) + 1] = { 0 };
+        memcpy(floor_no, record.floorNo, sizeof(record.floorNo));
+        memcpy(bitmap_name, record.bitmapName, sizeof(record.bitmapName));
+        memcpy(bitmap_name2, record.bitmapName2, sizeof(record.bitmapName2));
+
+        Mapping &mapping = this->mappinglist.map_list[ctr];
+        mapping.floorNo = internName(floor_no);
+        mapping.floorKey = _floorKey(floor_no);
+        mapping.bitmapName = internName(bitmap_name);
+        mapping.bitmapName2 = internName(bitmap_name2);
     }
-    fileClose();
+    this->mappinglist.n_mapped_floors = header.n_mapped_floors;
+    return true;
 }
 
 /**
- * @brief      Gets the previous file in the filesystem
- *
- * Note that this function is unsafe and will loop forever with a bad input argument
- *
- * @param      filename_current  Filename of the current file
- *
- * @return     The previous file
- */
-File Storage::fileGetPrevious(char filename_current[])
+* @brief      Fetches the mapping between floors and bitmaps
+*
+* Binary mapping files are read in one go, anything else is parsed as text.
+* Files of MAPPING_FILE_VERSION_FIXED are converted into the current layout.
+*
+* @param      mapFileName  Name of the file containing the mapping
+*
+* @return     MappingList containing the data or an empty struct if failed
+*/
+MappingList const& Storage::getMappingList(char mapFileName[])
 {
-    // Start looping over all of the files
-    File root = SD.open("enc");
-    File entry;
-
-    char filename_previous[30];
-    char filename_entry[30];
-
-    // Find the position of the current file
-    while (strcmp(filename_current, filename_entry) != 0)
+    // Serial.print("Fetching mapping list...\n");
+    if (!openToRead(mapFileName))
     {
-        strcpy(filename_previous, filename_entry);
+        Serial.print("Could not fetch mapping list.\n");
+        return this->mappinglist;
+    }
 
-        entry = root.openNextFile();
-        entry.getName(filename_entry, 30);
+    // Headers of both versions start the same, the shorter one is read first
+    MappingHeader header;
+    MappingHeaderFixed header_fixed;
+    if (this->file.read((uint8_t *)&header_fixed, sizeof(header_fixed)) == sizeof(header_fixed) &&
+        header_fixed.magic[0] == 'M' && header_fixed.magic[1] == 'L' &&
+        header_fixed.version == MAPPING_FILE_VERSION_FIXED)
+    {
+        if (!parseMappingFixed(header_fixed))
+        {
+            Serial.print("Mapping list is corrupted.\n");
+            allocateMappingList(0, 0);
+        }
+    }
+    else if (this->file.seek(0) && this->file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+             header.magic[0] == 'M' && header.magic[1] == 'L')
+    {
+        uint16_t const records_size = header.n_records * sizeof(Mapping);
+        if (header.version != MAPPING_FILE_VERSION ||
+            allocateMappingList(header.n_records, header.pool_size + STORAGE_POOL_SLACK) != 0 ||
+            this->file.read((uint8_t *)this->mappinglist.map_list, records_size) != records_size ||
+            this->file.read((uint8_t *)this->mappinglist.pool, header.pool_size) != header.pool_size ||
+            crc16((uint8_t *)this->mappinglist.pool, header.pool_size,
+                  crc16((uint8_t *)this->mappinglist.map_list, records_size)) != header.crc)
+        {
+            Serial.print("Mapping list is corrupted.\n");
+            allocateMappingList(0, 0);
+        }
+        else
+        {
+            this->mappinglist.pool_used = header.pool_size;
+            this->mappinglist.n_mapped_floors = header.n_mapped_floors;
+            this->pool_committed = header.pool_size;
+            this->pool_compacted = false;
+        }
+    }
+    else
+    {
+        parseMappingText();
     }
+    buildFloorIndex();
 
-    char filepath[30] = "/enc/";
-    strcat(filepath, filename_previous);
-    entry = SD.open(filepath);
-    root.close();
-    return entry;
+    closeRead();
+    // Serial.print("Mapping list fetched successfully.\n");
+    return this->mappinglist;
 }
 
 /**
- * @brief      Gets the next file in the filesystem
- *
- * Note that this function is unsafe and will loop forever with a bad input argument
- *
- * @param      filename_current  Filename of the current file
- *
- * @return     The next file
- */
-File Storage::fileGetNext(char filename_current[])
+* @brief      Gets the mapping between floors and bitmaps currently loaded, including changes not yet committed
+*
+* @return     MappingList containing the data
+*/
+MappingList const& Storage::getMappingList()
 {
-    // Start looping over all of the files
-    File root = SD.open("enc");
-    File entry;
-
-    char filename_entry[30];
-
-    // Find the position of the current file
-    while (strcmp(filename_current, filename_entry) != 0)
-    {
-        entry = root.openNextFile();
-        entry.getName(filename_entry, 30);
-    }
-
-    char filepath[30] = "/enc/";
-    entry = root.openNextFile();
-    entry.getName(filename_current, 30);
-    strcat(filepath, filename_current);
-    entry = SD.open(filepath);
-    root.close();
-    return entry;
+    return this->mappinglist;
 }
 
 /**
- * @brief      Load mono_color from SD card
- *
- * @return     Value of Display::mono_color
- */
-uint16_t Storage::fileGetMonoColor()
+* @brief      Imports a mapping in text format into the MappingList structure
+*
+* @param      textFileName  Name of the .txt file containing the mapping
+*
+* @return     0 if successful, -1 otherwise
+*/
+int Storage::importMappingList(char textFileName[])
 {
-    char filename[20] = "monocolor";
-    uint16_t mono_color = 0xF800;
-    if (fileOpenToRead(filename))
+    if (!openToRead(textFileName))
     {
-        fileReadData((uint8_t *)&mono_color, 2);
-        fileClose();
+        return -1;
     }
-    return mono_color;
+    parseMappingText();
+    buildFloorIndex();
+    closeRead();
+    return 0;
 }
 
 /**
- * @brief      Saves the color used by the Display
- *
- * @param      mono_color  Color to save
- */
-void Storage::fileSaveMonoColor(uint16_t mono_color)
+* @brief      Exports the MappingList structure in text format
+*
+* @param      textFileName  Name of the .txt file to hold the mapping
+*
+* @return     0 if successful, -1 otherwise
+*/
+int Storage::exportMappingList(char textFileName[])
 {
-    char filename[20] = "monocolor";
-    if (fileOpenToWrite(filename, true) && fileWriteData((uint8_t *)&mono_color, 2) == 2)
+    File text_file = openToWrite(textFileName, true);
+    if (!text_file)
     {
-        fileClose();
+        return -1;
     }
-    else
+
+    for (uint16_t ctr = 0; ctr < this->mappinglist.n_floors; ctr++)
     {
-        Serial.println("Failed to save color!");
+        //Commit ith mapping to file
+        Mapping const &mapping = this->mappinglist.map_list[ctr];
+        text_file.print(getMappingName(mapping.floorNo));
+        text_file.print(',');
+        text_file.print(getMappingName(mapping.bitmapName));
+        text_file.print(',');
+        text_file.print(getMappingName(mapping.bitmapName2));
+        text_file.print('\n');
     }
+    text_file.print("$\n"); //EOF
+    text_file.close();
+    return 0;
 }
 
 /**
-* @brief      Fetches the mapping between floors and bitmaps
+* @brief      Commits the mappinglist structure to mapping.ini file
 *
-* @param      mapFileName  Name of the .txt file containing the mapping
+* @param      mapFileName  Name of the file to hold the mapping
 *
-* @return     MappingList containing the data or an empty struct if failed
+* @return     0 if successful, -1 otherwise
 */
-MappingList const& Storage::getMappingList(char mapFileName[])
+int Storage::commitMappingList(char mapFileName[]) //Needs to be called in the destructor of the Storage class, commits all changes to "mapping.ini" file for reuse
 {
-    // Serial.print("Fetching mapping list...\n");
-    if (!this->fileOpenToRead(mapFileName))
+    Serial.print("Saving MappingList...\n");
+    File mapping_file = openToWrite(mapFileName, true);
+    if (!mapping_file)
     {
-        Serial.print("Could not fetch mapping list.\n");
-        return this->mappinglist;
+        return -1;
     }
     else
     {
-        this->fileOpenToRead(mapFileName);
-
-        char c;
-        char floor_no[3] = "$";
-        char bmp_name[20] = "$";
-        char bmp_name2[20] = "$";
-
-        bool comma1_reached = false;
-        bool comma2_reached = false;
-
-        uint32_t ctr = 0;
-        uint32_t list_itr = 0;
-        uint32_t mapped_floor_count = 0;
-
-        do
-        {
-            c = this->file.read();
-            if (c == '$') //indicates EOF
-                break;
-
-            if (c == ',' && !comma1_reached && !comma2_reached) //separates floor number from bitmap names
-            {
-                floor_no[ctr] = '\0';
-                strcpy(this->mappinglist.map_list[list_itr].floorNo, floor_no);
-                comma1_reached = true;
-                ctr = 0;
-            }
-            else if (c == ',' && comma1_reached && !comma2_reached) //separates first bitmap name from second bitmap name
-            {
-                bmp_name[ctr] = '\0';
-                strcpy(this->mappinglist.map_list[list_itr].bitmapName, bmp_name);
-                comma2_reached = true;
-                ctr = 0;
-            }
-            else if (c == '\n') //indicates end of a mapping
-            {
-                bmp_name2[ctr] = '\0';
-                strcpy(this->mappinglist.map_list[list_itr].bitmapName2, bmp_name2);
-                comma1_reached = false;
-                comma2_reached = false;
-                ctr = 0;
-                if (strcmp(bmp_name, "\0") || strcmp(bmp_name2, "\0"))
-                    mapped_floor_count++;
-                list_itr++;
-            }
-
-            if (!comma1_reached && !comma2_reached && c != '\n') //the program is still reading the floor number character by character
-                floor_no[ctr++] = c;
-            else if (comma1_reached && !comma2_reached && c != ',') //the program is still reading the first bitmap name
-                bmp_name[ctr++] = c;
-            else if (comma1_reached && comma2_reached && c != ',') //the program is still reading the second bitmap name
-                bmp_name2[ctr++] = c;
-        } while (1);
-
-        this->mappinglist.n_mapped_floors = mapped_floor_count;
-        this->file.close();
-        // Serial.print("Mapping list fetched successfully.\n");
-        return this->mappinglist;
+        MappingHeader header;
+        fillMappingHeader(header);
+        mapping_file.write((uint8_t *)&header, sizeof(header));
+        mapping_file.write((uint8_t *)this->mappinglist.map_list, this->mappinglist.n_floors * sizeof(Mapping));
+        mapping_file.write((uint8_t *)this->mappinglist.pool, this->mappinglist.pool_used);
+        mapping_file.close();
+        this->pool_committed = this->mappinglist.pool_used;
+        this->pool_compacted = false;
+        Serial.println("MappingList saved.");
+        return 0;
     }
 }
 
 /**
-* @brief      Commits the mappinglist structure to mapping.ini file
+* @brief      Commits the mapping of a single floor to a binary mapping file, rewriting only its record
+*
+* Names added since the last commit are appended to the pool at the end of the file.
+* Falls back to committing the whole MappingList if the file doesn't match the layout in memory.
 *
-* @param      mapFileName  Name of the .txt file to hold the mapping
+* @param      mapFileName  Name of the file holding the mapping
+* @param      floorNo  Char array specifying floorNo to commit
 *
 * @return     0 if successful, -1 otherwise
 */
-int Storage::commitMappingList(char mapFileName[]) //Needs to be called in the destructor of the Storage class, commits all changes to "mapping.ini" file for reuse
+int Storage::commitFloorMapping(char mapFileName[], char floorNo[])
 {
-    Serial.print("Saving MappingList...\n");
-    if (!this->fileOpenToWrite(mapFileName, true))
+    int loc = findFromFloorNo(floorNo);
+    if (loc == -1)
     {
+        Serial.println("Specified floor does not exist.");
         return -1;
     }
-    else
+
+    File mapping_file = this->pool_compacted ? File() : openToWrite(mapFileName, false);
+    if (!mapping_file)
+    {
+        return commitMappingList(mapFileName);
+    }
+
+    MappingHeader header;
+    uint32_t const records_size = this->mappinglist.n_floors * sizeof(Mapping);
+    mapping_file.seek(0);
+    if (mapping_file.size() != sizeof(header) + records_size + this->pool_committed ||
+        mapping_file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        header.magic[0] != 'M' || header.magic[1] != 'L' || header.version != MAPPING_FILE_VERSION ||
+        header.n_records != this->mappinglist.n_floors)
+    {
+        mapping_file.close();
+        return commitMappingList(mapFileName);
+    }
+
+    // Rewrite the record and append new names, then the header as its checksum changed
+    mapping_file.seek(sizeof(header) + loc * sizeof(Mapping));
+    mapping_file.write((uint8_t *)&this->mappinglist.map_list[loc], sizeof(Mapping));
+    if (this->mappinglist.pool_used > this->pool_committed)
+    {
+        mapping_file.seek(sizeof(header) + records_size + this->pool_committed);
+        mapping_file.write((uint8_t *)this->mappinglist.pool + this->pool_committed, this->mappinglist.pool_used - this->pool_committed);
+        this->pool_committed = this->mappinglist.pool_used;
+    }
+
+    // Other records may only have changed in memory, so the header describes the file as written
+    header.n_mapped_floors = 0;
+    header.pool_size = this->pool_committed;
+    header.crc = 0xFFFF;
+    mapping_file.seek(sizeof(header));
+    for (uint16_t ctr = 0; ctr < header.n_records; ctr++)
     {
-        uint32_t ctr = 0;
-        for (ctr = 0; ctr <= 31; ctr++)
+        Mapping record;
+        if (mapping_file.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
         {
-            String _str_floorNo(this->mappinglist.map_list[ctr].floorNo);
-            String _str_bitmapName(this->mappinglist.map_list[ctr].bitmapName);
-            String _str_bitmapName2(this->mappinglist.map_list[ctr].bitmapName2);
-            this->file.print(_str_floorNo + ',' + _str_bitmapName + ',' + _str_bitmapName2 + '\n'); //Commit ith mapping to file
+            mapping_file.close();
+            return commitMappingList(mapFileName);
         }
-        this->file.print("$\n"); //EOF
-        this->file.close();
-        Serial.println("MappingList saved.");
-        return 0;
+        if (record.bitmapName != 0 || record.bitmapName2 != 0)
+            header.n_mapped_floors++;
+        header.crc = crc16((uint8_t *)&record, sizeof(record), header.crc);
+    }
+    uint8_t buffer[32];
+    for (uint16_t done = 0; done < header.pool_size;)
+    {
+        int const amount = mapping_file.read(buffer, min(header.pool_size - done, (int)sizeof(buffer)));
+        if (amount <= 0)
+        {
+            mapping_file.close();
+            return commitMappingList(mapFileName);
+        }
+        header.crc = crc16(buffer, amount, header.crc);
+        done += amount;
     }
+    mapping_file.seek(0);
+    mapping_file.write((uint8_t *)&header, sizeof(header));
+    mapping_file.close();
+    return 0;
 }
 
 /**
@@ -853,7 +3162,7 @@ int Storage::commitMappingList(char mapFileName[]) //Needs to be called in the d
 */
 int Storage::setFloorMapping(char floorNo[], char bitmapName[], char bitmapName2[])
 {
-    uint32_t loc = findFromFloorNo(floorNo);
+    int loc = findFromFloorNo(floorNo);
     if (loc == -1)
     {
         Serial.println("Specified floor does not exist.");
@@ -861,8 +3170,25 @@ int Storage::setFloorMapping(char floorNo[], char bitmapName[], char bitmapName2
     }
     else
     {
-        strcpy(this->mappinglist.map_list[loc].bitmapName, bitmapName);
-        strcpy(this->mappinglist.map_list[loc].bitmapName2, bitmapName2);
+        // Interning might move the pool, so each name is stored before the next is interned
+        uint16_t const previous = this->mappinglist.map_list[loc].bitmapName;
+        uint16_t const name = internName(bitmapName);
+        if (name == 0 && bitmapName[0] != '\0')
+        {
+            Serial.println("Failed to store bitmap name!");
+            return -1;
+        }
+        this->mappinglist.map_list[loc].bitmapName = name;
+        uint16_t const name2 = internName(bitmapName2);
+        if (name2 == 0 && bitmapName2[0] != '\0')
+        {
+            // The pool was left as it was, so the previous name is still in place
+            this->mappinglist.map_list[loc].bitmapName = previous;
+            Serial.println("Failed to store bitmap name!");
+            return -1;
+        }
+        this->mappinglist.map_list[loc].bitmapName2 = name2;
+        buildBitmapIndex();
         // Serial.print("Floor mapping set successfully.\n");
         return 0;
     }
@@ -877,7 +3203,7 @@ int Storage::setFloorMapping(char floorNo[], char bitmapName[], char bitmapName2
 */
 int Storage::removeFloorMapping(char floorNo[])
 {
-    uint32_t loc = findFromFloorNo(floorNo);
+    int loc = findFromFloorNo(floorNo);
     if (loc == -1)
     {
         Serial.println("Specified floor does not exist.");
@@ -885,37 +3211,75 @@ int Storage::removeFloorMapping(char floorNo[])
     }
     else
     {
-        strcpy(this->mappinglist.map_list[loc].bitmapName, "\0");
-        strcpy(this->mappinglist.map_list[loc].bitmapName2, "\0");
+        this->mappinglist.map_list[loc].bitmapName = 0;
+        this->mappinglist.map_list[loc].bitmapName2 = 0;
+        buildBitmapIndex();
         // Serial.print("Floor mapping removed successfully.\n");
         return 0;
     }
 }
 
 /**
-* @brief      Finds the mapping list index corresponding to the mapping containing the specified floorNo
+* @brief      Builds the lookup tables for floors and bitmap names from the MappingList structure
 *
-* @param      floorNo  Char array specifying floorNo to search for
-*
-* @return     index corresponding to the mapping containing the specified floorNo if found, -1 otherwise
+* Needs to be called whenever floors are loaded. Slots are filled in list order, so
+* lookups find the first matching mapping like a linear search would.
 */
-int Storage::findFromFloorNo(char floorNo[])
+void Storage::buildFloorIndex()
 {
-    uint32_t ctr;
-    for (ctr = 0; ctr <= 31; ctr++)
+    memset(this->floor_slots, -1, this->floor_slot_count * sizeof(int16_t));
+    for (uint16_t ctr = 0; ctr < this->mappinglist.n_floors; ctr++)
     {
-        if (!strcmp(this->mappinglist.map_list[ctr].floorNo, floorNo))
-            break;
+        uint16_t slot = _floorSlot(this->mappinglist.map_list[ctr].floorKey, this->floor_slot_count);
+        while (this->floor_slots[slot] != -1)
+        {
+            slot = (slot + 1) % this->floor_slot_count;
+        }
+        this->floor_slots[slot] = ctr;
     }
+    buildBitmapIndex();
+}
 
-    if (ctr == 32)
+/**
+* @brief      Builds the lookup table for bitmap names from the MappingList structure
+*
+* Needs to be called whenever bitmap names of mappings change.
+*/
+void Storage::buildBitmapIndex()
+{
+    memset(this->bitmap_slots, -1, this->floor_slot_count * sizeof(int16_t));
+    for (uint16_t ctr = 0; ctr < this->mappinglist.n_floors; ctr++)
     {
-        return -1;
+        Mapping const &mapping = this->mappinglist.map_list[ctr];
+        uint16_t slot = _bitmapSlot(getMappingName(mapping.bitmapName), getMappingName(mapping.bitmapName2), this->floor_slot_count);
+        while (this->bitmap_slots[slot] != -1)
+        {
+            slot = (slot + 1) % this->floor_slot_count;
+        }
+        this->bitmap_slots[slot] = ctr;
     }
-    else
+}
+
+/**
+* @brief      Finds the mapping list index corresponding to the mapping containing the specified floorNo
+*
+* @param      floorNo  Char array specifying floorNo to search for
+*
+* @return     index corresponding to the mapping containing the specified floorNo if found, -1 otherwise
+*/
+int Storage::findFromFloorNo(char floorNo[])
+{
+    int16_t const key = _floorKey(floorNo);
+    for (uint16_t slot = _floorSlot(key, this->floor_slot_count); this->floor_slots[slot] != -1; slot = (slot + 1) % this->floor_slot_count)
     {
-        return ctr;
+        Mapping const &mapping = this->mappinglist.map_list[this->floor_slots[slot]];
+        // Hashed keys of non-numeric floors might collide
+        if (mapping.floorKey == key && (key >= -999 || strcasecmp(getMappingName(mapping.floorNo), floorNo) == 0))
+        {
+            return this->floor_slots[slot];
+        }
     }
+    return -1;
 }
 
 /**
@@ -927,64 +3291,62 @@ int Storage::findFromFloorNo(char floorNo[])
 */
 int Storage::findFromBitmapName(char bitmapName[], char bitmapName2[])
 {
-    uint32_t ctr;
-    for (ctr = 0; ctr <= 31; ctr++)
-    {
-        if (!strcmp(this->mappinglist.map_list[ctr].bitmapName, bitmapName) && !strcmp(this->mappinglist.map_list[ctr].bitmapName2, bitmapName2))
-            break;
-    }
-
-    if (ctr == 32)
-    {
-        return -1;
-    }
-    else
+    for (uint16_t slot = _bitmapSlot(bitmapName, bitmapName2, this->floor_slot_count); this->bitmap_slots[slot] != -1; slot = (slot + 1) % this->floor_slot_count)
     {
-        return ctr;
+        Mapping const &mapping = this->mappinglist.map_list[this->bitmap_slots[slot]];
+        if (!strcmp(getMappingName(mapping.bitmapName), bitmapName) && !strcmp(getMappingName(mapping.bitmapName2), bitmapName2))
+        {
+            return this->bitmap_slots[slot];
+        }
     }
+    return -1;
 }
 
 /**
-* @brief      Initializes a blank mapping file containing 32 entries (corresponding to 32 floors)
+* @brief      Initializes a blank mapping file containing an entry for each floor
+*
+* @param      mapFileName  Name of the file to hold the mapping
+* @param      floors  Amount of floors, numbered from 1
 *
 * @return     0 if successful, -1 otherwise
 */
-int Storage::initMappingList(char mapFileName[])
+int Storage::initMappingList(char mapFileName[], uint16_t floors)
 {
     Serial.print("Initializing mapping list...\n");
-    if (!this->fileOpenToWrite(mapFileName, true))
+    // Floor numbers take at most 5 characters plus terminator
+    if (allocateMappingList(floors, floors * 6 + STORAGE_POOL_SLACK) != 0)
     {
         return -1;
     }
-    else
+    for (uint16_t ctr = 0; ctr < floors; ctr++)
     {
-        uint32_t ctr = 0;
-        for (ctr = 0; ctr <= 31; ctr++)
-        {
-            String _str_floorNo = String(ctr + 1);
-            String _str_bitmapName = "";
-            String _str_bitmapName2 = "";
-            this->file.println(_str_floorNo + ',' + _str_bitmapName + ',' + _str_bitmapName2); //Commit ith mapping to file
-        }
-        this->file.println("$"); //EOF
-        this->file.close();
-        Serial.print("Mapping list initialized successfully.\n");
-        return 0;
+        char floor_no[6];
+        utoa(ctr + 1, floor_no, 10);
+        this->mappinglist.map_list[ctr].floorNo = internName(floor_no);
+        this->mappinglist.map_list[ctr].floorKey = _floorKey(floor_no);
+    }
+    buildFloorIndex();
+
+    if (commitMappingList(mapFileName) != 0)
+    {
+        return -1;
     }
+    Serial.print("Mapping list initialized successfully.\n");
+    return 0;
 }
 
 /**
 * @brief      Updates the mapping for the specified floorNo with the specified bitmapName
 *
 * @param      floorNo  Char array specifying floorNo to be mapped
-* @param      bmp1  Pointer to char array that will hold first bitmap name
-* @param      bmp2  Pointer to char array that will hold second bitmap name
+* @param      bmp1  Pointer to char array that will hold first bitmap name, large enough for the longest name
+* @param      bmp2  Pointer to char array that will hold second bitmap name, large enough for the longest name
 *
 * @return     0 if successful, -1 otherwise
 */
 int Storage::getFloorMapping(char floorNo[], char bitmapName[], char bitmapName2[])
 {
-    uint32_t loc = findFromFloorNo(floorNo);
+    int loc = findFromFloorNo(floorNo);
     if (loc == -1)
     {
         Serial.print("Specified floor does not exist.\n");
@@ -992,8 +3354,8 @@ int Storage::getFloorMapping(char floorNo[], char bitmapName[], char bitmapName2
     }
     else
     {
-        strcpy(bitmapName, this->mappinglist.map_list[loc].bitmapName);
-        strcpy(bitmapName2, this->mappinglist.map_list[loc].bitmapName2);
+        strcpy(bitmapName, getMappingName(this->mappinglist.map_list[loc].bitmapName));
+        strcpy(bitmapName2, getMappingName(this->mappinglist.map_list[loc].bitmapName2));
         // Serial.print("Floor mapping retrieved successfully.\n");
         return 0;
     }
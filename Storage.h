@@ -5,6 +5,54 @@
 
 #include <stdint.h>
 
+// Size of one SD card sector
+#define STORAGE_SECTOR_SIZE 512
+// Size of the bitmap file header plus BITMAPINFOHEADER
+#define BITMAP_HEADER_SIZE 54
+// Size of a single scanline record in an encoded .cbm file
+#define CBM_RECORD_SIZE 8
+// Rows per entry of the row index at the end of a .cbm file
+#define CBM_INDEX_STRIDE 8
+// Size of the trailer locating the row index: uint16 rows, 'R', 'X', uint32 index offset
+#define CBM_TRAILER_SIZE 8
+// Version of the .cbm files written by the encoder, files without a header are version 1
+#define CBM_VERSION 2
+// Size of the header of .cbm files: 'C', 'B', version, flags, uint16 width, uint16 height
+#define CBM_HEADER_SIZE 8
+// Flags of the .cbm header
+#define CBM_FLAG_ROW_INDEX 0x01
+#define CBM_FLAG_COLOR 0x02 // Scanlines cover every pixel and carry an RGB565 color
+// Amount of pixels of a color bitmap read at once while encoding
+#define STORAGE_COLOR_SLICE 32
+// Index of bitmaps already encoded, kept in the root
+#define STORAGE_INDEX_FILE "encindx3"
+#define STORAGE_INDEX_TEMP "encindex.tmp"
+// Indices written by earlier versions, without content hashes or with encoded names
+#define STORAGE_INDEX_LEGACY "encindex"
+#define STORAGE_INDEX_NAMED "encindx2"
+// Version of the binary mapping file format
+#define MAPPING_FILE_VERSION 2
+// Version of binary mapping files with the names stored in fixed records, converted when read
+#define MAPPING_FILE_VERSION_FIXED 1
+// Extra bytes reserved for names added after loading a mapping list
+#define STORAGE_POOL_SLACK 64
+// Longest line of a mapping in text format
+#define STORAGE_MAPPING_LINE 96
+// Maximum amount of encoded bitmaps that can be browsed
+#ifndef STORAGE_BROWSE_CAPACITY
+#define STORAGE_BROWSE_CAPACITY 128
+#endif
+// Bytes of encoded bitmaps kept in memory by the prefetch cache
+#ifndef STORAGE_CACHE_SIZE
+#define STORAGE_CACHE_SIZE 1024
+#endif
+// Maximum amount of encoded bitmaps in the prefetch cache
+#define STORAGE_CACHE_SLOTS 4
+// Bytes cached of a bitmap too large for the prefetch cache, the rows at its top drawn first
+#define STORAGE_CACHE_STRIP (STORAGE_CACHE_SIZE / STORAGE_CACHE_SLOTS)
+// Amount of upcoming floors prefetched in the direction of travel
+#define STORAGE_PREFETCH_FLOORS 2
+
 typedef enum e_bitmap_type
 {
     file_error = -1,
@@ -15,30 +63,156 @@ typedef enum e_bitmap_type
     rgb888_compressed = 4
 } BitmapType;
 
+typedef struct s_scanline
+{
+    // Structure holding a single run of set pixels of an encoded bitmap
+    uint16_t row;
+    uint16_t start;
+    uint16_t end; // Exclusive
+    uint16_t color; // RGB565 with the high byte first in memory, as sent to the display, 0xFFFF in monochrome bitmaps
+} Scanline;
+
 typedef struct s_bitmap
 {
     int32_t width = -1;
     int32_t height = -1;
     BitmapType type = BitmapType::file_error;
+    // Rows held in data, numbered in file order
+    uint16_t first_row = 0;
+    uint16_t rows = 0;
+    // Amount of scanlines held in data when type is monochrome_compressed or rgb888_compressed
+    uint16_t runs = 0;
     union {
         uint16_t *pixels;
         uint8_t *data;
+        Scanline *scanlines;
     };
 } Bitmap;
 
+typedef struct s_encoded_source
+{
+    // Structure holding where encoded data is read from, either a file or memory
+    File *file = nullptr;
+    uint8_t const *data = nullptr; // Used if file is null
+    uint32_t size = 0;
+    uint32_t position = 0;
+    uint32_t prefix = 0; // Bytes at the start of file also held in data, which are read from there
+    uint8_t *block = nullptr; // Sector buffer of its own the file is read through, if not null
+    uint32_t block_start = 0; // Offset of the sector held in block
+    uint16_t block_size = 0; // Bytes held in block, 0 if none
+} EncodedSource;
+
+typedef struct s_run_iterator
+{
+    // Structure holding the state of decoding the scanlines of an encoded bitmap
+    EncodedSource source;
+    uint8_t version = 0;
+    uint8_t flags = 0;
+    uint16_t width = 0; // 0 if unknown
+    uint16_t height = 0;
+    uint32_t data_end = 0; // Offset where scanlines end
+    uint16_t row = 0; // Row of the scanlines being decoded
+    uint16_t next_row = 0; // Row of the next group of scanlines
+    uint16_t remaining = 0; // Scanlines left in the current row
+    uint16_t end = 0; // End of the previous scanline in the current row
+} RunIterator;
+
+typedef struct s_row_buffer_stats
+{
+    // Structure holding usage statistics of the row buffer of Storage
+    uint16_t capacity; // Bytes currently allocated
+    uint16_t high_water; // Most bytes ever requested
+    uint16_t grows; // Amount of reallocations after the first one
+} RowBufferStats;
+
+typedef struct s_bitmap_header
+{
+    // Structure holding the parsed header of the open bitmap file
+    bool valid = false;
+    uint32_t offset = 0; // Where the pixel data begins
+    uint16_t dib_size = 0;
+    int32_t width = -1;
+    int32_t height = -1; // Always positive
+    uint16_t bits_per_pixel = 0;
+    uint32_t compression_method = 0;
+    uint32_t row_stride = 0; // Bytes per row including padding
+} BitmapHeader;
+
+// Reports progress of long operations, such as Storage::fileCopy
+typedef void (*StorageProgress)(uint32_t done, uint32_t total);
+// Receives the scanlines of an encoded bitmap one at a time, see Storage::streamSpans
+typedef void (*StorageSpan)(Scanline const &span);
+
+typedef struct s_cache_entry
+{
+    // Structure holding a single encoded bitmap kept in the prefetch cache
+    char filepath[30]; // Empty if unused
+    uint16_t offset; // Position in the cache
+    uint16_t size; // Bytes cached from the start of the file
+    uint16_t used; // When last used, to evict the least recently used
+    bool complete; // Whether the whole file is cached, otherwise only the rows at its top
+} CacheEntry;
+
+typedef struct s_encoded_record
+{
+    // Structure holding a single record of the encoded bitmap index
+    char bitmapName[20];
+    uint32_t size;
+    uint32_t modified; // FAT date << 16 | FAT time
+    uint16_t hash; // CRC16 of the content of the file
+} EncodedRecord;
+
 typedef struct s_mapping
 {
     // Structure holding a single mapping between bitmap and floor number
+    // Names are offsets into the string pool of the MappingList, 0 = empty
+    int16_t floorKey; // Normalized floorNo used for lookups
+    uint16_t floorNo;
+    uint16_t bitmapName;
+    uint16_t bitmapName2;
+} Mapping;
+
+typedef struct s_mapping_header
+{
+    // Structure heading a binary mapping file, followed by n_records Mapping records and the names
+    char magic[2]; // "ML"
+    uint8_t version;
+    uint8_t reserved;
+    int32_t n_mapped_floors;
+    uint16_t n_records;
+    uint16_t pool_size; // Bytes of names following the records
+    uint16_t crc; // CRC16 of the records and names
+} MappingHeader;
+
+typedef struct s_mapping_header_fixed
+{
+    // Structure heading a binary mapping file of MAPPING_FILE_VERSION_FIXED, followed by n_records MappingFixed records
+    char magic[2]; // "ML"
+    uint8_t version;
+    uint8_t reserved;
+    int32_t n_mapped_floors;
+    uint16_t n_records;
+    uint16_t crc; // CRC16 of the records
+} MappingHeaderFixed;
+
+typedef struct s_mapping_fixed
+{
+    // Record of a binary mapping file of MAPPING_FILE_VERSION_FIXED
     char floorNo[3];
     char bitmapName[20];
-	char bitmapName2[20];
-} Mapping;
+    char bitmapName2[20];
+} MappingFixed;
 
 typedef struct s_mapping_list
 {
     // Structure holding a list of mappings, plus some misc. info.
+    // Mappings and names live in a single arena owned by Storage
     int32_t n_mapped_floors = -1;
-    Mapping map_list[32]; //32 maximum floors
+    uint16_t n_floors = 0;
+    Mapping *map_list = nullptr;
+    char *pool = nullptr; // Zero-terminated names, each stored once
+    uint16_t pool_used = 0;
+    uint16_t pool_size = 0;
 } MappingList;
 
 class Storage
@@ -56,45 +230,143 @@ public:
 
     // Bitmap functions
     Bitmap const& getBitmap(char filepath[], uint16_t row, uint16_t amount);
+    void getEncodedPath(char filepath[], char filepath_encoded[]);
+    int32_t streamSpans(char filepath[], StorageSpan span, uint16_t row=0, uint16_t amount=UINT16_MAX);
+    int32_t streamComposedSpans(char filepath[], char filepath_overlay[], StorageSpan span, uint16_t row=0, uint16_t amount=UINT16_MAX);
+    int32_t streamFloorSpans(char floorNo[], StorageSpan span, uint16_t row=0, uint16_t amount=UINT16_MAX);
     // File functions
     bool fileOpenToRead(char filepath[]);
     bool fileOpenToWrite(char filepath[], bool overwrite=false);
+    bool fileOpenToWritePreallocated(char filepath[], uint32_t size);
+    int32_t fileOpenToResume(char filepath[], uint16_t alignment);
+    bool fileRename(char source[], char dest[]);
     uint32_t fileSize();
+    bool fileIsPreallocated();
+    bool fileSeek(uint32_t position);
+    uint16_t getFileHash(char filepath[]);
     int32_t fileReadData(uint8_t buffer[], uint16_t amount);
     int32_t fileWriteData(uint8_t data[], uint16_t amount);
+    int32_t fileWriteSectors(uint8_t data[], uint16_t count);
     bool fileClose();
-    bool fileCopy(char source[], char dest[], bool overwrite=false);
+    bool fileCopy(char source[], char dest[], bool overwrite=false, StorageProgress progress=nullptr);
     // Browsing functions
     File fileGetPrevious(char filename_current[]);
     File fileGetNext(char filepath_current[]);
+    File fileGetAt(uint16_t position);
+    uint16_t fileCount();
+    void invalidateBrowseIndex();
+    // Prefetch cache functions
+    bool prefetchBitmap(char filepath[]);
+    void hintTravel(char floorNo[], int8_t direction);
+    void invalidateCache();
+    // Memory statistics of the row buffer bitmaps are decoded into
+    RowBufferStats getRowBufferStats();
     // Other file saving convenience functions
     uint16_t fileGetMonoColor();
     void fileSaveMonoColor(uint16_t mono_color);
     // Floor mapping functions
     MappingList const& getMappingList(char mapFileName[]); //Read data from "data\mapping.ini" into MappingList structure
+    MappingList const& getMappingList(); //Get the MappingList structure currently loaded
     int commitMappingList(char mapFileName[]); //Commit current MappingList structure to "data\mapping.ini"
+    int commitFloorMapping(char mapFileName[], char floorNo[]); //Commit the mapping of one floor in place to "data\mapping.ini"
+    int importMappingList(char textFileName[]); //Read a mapping in text format into MappingList structure
+    int exportMappingList(char textFileName[]); //Write current MappingList structure in text format
     int setFloorMapping(char floorNo[], char bitmapName[], char bitmapName2[]); //Set mapping between specified parameters in MappingList structure
     int removeFloorMapping(char floorNo[]); //Remove mapping between specified parameters in MappingList structure 
     int getFloorMapping(char floorNo[], char bitmapName[], char bitmapName2[]); //Get mapping for indicated floors, stored in bitmapName and bitmapName2 arrays
-    int initMappingList(char mapFileName[]); //Initialize a blank mapping file containing 32 entries (corresponding to 32 floors)
+    int initMappingList(char mapFileName[], uint16_t floors=32); //Initialize a blank mapping file containing an entry for each floor
+    char const *getMappingName(uint16_t offset); //Get a name of a Mapping from the string pool
+    uint16_t getMappingHash(uint16_t index); //Get a hash of the floor and names of a Mapping
     
 private:
     // Don't allow any external parties to construct a Storage instance
     Storage();
+    void updateEncodedIndex();
+    void invalidateIndexRecord(char filepath[]);
+    bool openToRead(char filepath[]);
+    File openToWrite(char filepath[], bool overwrite);
+    void closeRead();
+    void endRawWrite();
+    void buildBrowseIndex();
+    int32_t findBrowsePosition(char filename[]);
+    int8_t findCacheEntry(char const filepath[]);
+    void readFromCache(EncodedSource &source, int8_t cached);
+    uint16_t compactCache();
+    bool readHeader();
+    bool reserveRowBuffer(uint32_t bytes);
     void readMono40(uint16_t row, uint16_t amount);
     void readBitmap(uint16_t row, uint16_t amount);
-    uint16_t findPixel(bool pixel_state, int16_t offset);
-    void findScanline(int16_t row, int16_t &start, int16_t &end, int16_t offset=-1);
-    void writeCompressedBlock(char filename[], uint16_t row, uint16_t start, uint16_t end);
+    void readEncoded(EncodedSource const &source, uint16_t row, uint16_t amount);
+    bool openSpans(char filepath[], RunIterator &runs, uint16_t row, uint8_t overlay_block[]=nullptr);
+    void writeEncodedByte(File &encoded, uint8_t buffer[], uint16_t &buffered, uint8_t value);
+    void writeVarint(File &encoded, uint8_t buffer[], uint16_t &buffered, uint16_t value);
+    bool encodeMonoRow(File &encoded, uint8_t buffer[], uint16_t &buffered);
+    bool encodeColorRow(File &encoded, uint8_t buffer[], uint16_t &buffered);
     void encodeBitmap(char filename_original[], char filename_encoded[]);
+    void fillMappingHeader(MappingHeader &header);
+    int allocateMappingList(uint16_t floors, uint16_t pool_size);
+    uint16_t internName(char const name[]);
+    bool readMappingLine(char line[]);
+    void parseMappingText();
+    bool parseMappingFixed(MappingHeaderFixed const &header);
+    void buildFloorIndex();
+    void buildBitmapIndex();
 	int findFromFloorNo(char floorNo[]); //Return the index corresponding to mapping containing the specified floorNo
 	int findFromBitmapName(char bitmapName[], char bitmapName2[]); //Return the index corresponding to mapping containing the specified bitmapName
-    /** @brief File handle to use internally */
+    /** @brief File handle to use internally for reading */
     File file;
+    /** @brief File handle of Storage::fileOpenToRead, only ever closed or replaced by its caller */
+    File file_read;
+    /** @brief File handle of Storage::fileOpenToWrite, only ever closed or replaced by its caller */
+    File file_write;
+    /** @brief File handle to use internally for reading the bitmap drawn over another, see Storage::streamComposedSpans */
+    File file_overlay;
+    /** @brief Whether sectors of file_write go straight to its contiguous blocks, see Storage::fileOpenToWritePreallocated */
+    bool raw_writing;
+    /** @brief First block of the contiguous file being written */
+    uint32_t raw_start;
+    /** @brief Next block to write of the contiguous file */
+    uint32_t raw_block;
+    /** @brief Block after the last one of the contiguous file */
+    uint32_t raw_end;
+    /** @brief Size reserved for the file open in file_write, 0 if it was not preallocated */
+    uint32_t preallocated;
+    /** @brief Color of monochrome bitmaps, kept from the file 'monocolor' */
+    uint16_t mono_color;
+    /** @brief Parsed header of the bitmap open in file */
+    BitmapHeader header;
     /** @brief Pointer to dynamically allocated data of last read bitmap */
     Bitmap bitmap;
+    /** @brief Usage of the buffer behind bitmap.data */
+    RowBufferStats row_buffer;
+    /** @brief Directory entry indices of the files in /enc, in directory order */
+    uint16_t browse_index[STORAGE_BROWSE_CAPACITY];
+    /** @brief Amount of files in browse_index */
+    uint16_t browse_count;
+    /** @brief Position last browsed to */
+    uint16_t browse_position;
+    /** @brief Whether browse_index matches the contents of /enc */
+    bool browse_valid;
+    /** @brief Encoded bitmaps kept in memory, see Storage::prefetchBitmap */
+    uint8_t cache_data[STORAGE_CACHE_SIZE];
+    /** @brief Where each encoded bitmap lies in cache_data */
+    CacheEntry cache_entries[STORAGE_CACHE_SLOTS];
+    /** @brief Counts uses of the cache, to know which entry was used last */
+    uint16_t cache_clock;
     /** @brief Pointer to dynamically allocated data of last read mapping file */
     MappingList mappinglist;
+    /** @brief Single allocation holding the mappings, lookup tables and names of mappinglist */
+    uint8_t *mapping_arena;
+    /** @brief Hash table from floor keys to mapping list indices, -1 = empty */
+    int16_t *floor_slots;
+    /** @brief Hash table from bitmap names to mapping list indices, -1 = empty */
+    int16_t *bitmap_slots;
+    /** @brief Amount of slots in each lookup table */
+    uint16_t floor_slot_count;
+    /** @brief Bytes of the pool already stored in the mapping file */
+    uint16_t pool_committed;
+    /** @brief Whether pool offsets have changed since the mapping file was written */
+    bool pool_compacted;
 };
 
 #endif
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <vector>
+
+#include "Storage.h"
+#include "Network.h"
+#include "Config.h"
+#include "Fixtures.h"
+#include "Scanline.h"
+
+// Benchmark of Storage and Network on the host, against the SD card and UART mocks.
+// Every figure is measured with the card latencies of mock/SdFat.h, and transfers
+// run between two processes over a link paced at the baud rate agreed by Network.
+
+// Minimum time each measurement runs for
+#ifndef BENCH_MIN_MS
+#define BENCH_MIN_MS 500
+#endif
+#ifndef BENCH_SEED
+#define BENCH_SEED 20261014
+#endif
+// Size of the file sent in the transfer measurements
+#ifndef BENCH_TRANSFER_SIZE
+#define BENCH_TRANSFER_SIZE 49152
+#endif
+// Time after which a node waiting in a transfer measurement gives up
+#ifndef BENCH_TRANSFER_TIMEOUT_MS
+#define BENCH_TRANSFER_TIMEOUT_MS 20000
+#endif
+// Baud rate of nodes predating Network::configureLink, the default of the HC-05
+#ifndef BENCH_LEGACY_BAUD
+#define BENCH_LEGACY_BAUD 38400
+#endif
+
+extern MockSdFat SD;
+
+static char _mono_path[] = "/plan2.bmp";
+static char _overlay_path[] = "/plan2_o.bmp";
+static char _color_path[] = "/color.bmp";
+static char _mono_encoded[] = "/enc/plan2.cbm";
+static char _color_encoded[] = "/enc/color.cbm";
+static char _text_path[] = "/map.txt";
+static char _mapping_path[] = "/mapping.bin";
+static char _transfer_path[] = "/xfer.bin";
+static uint16_t const _floors = 200;
+
+static uint32_t _spans;
+
+static void _countSpan(Scanline const &span)
+{
+    _spans++;
+}
+
+/**
+ * @brief      Repeats a step for at least BENCH_MIN_MS and prints how much it got done per second
+ *
+ * @param      name  Name of the measurement
+ * @param      unit  Unit of what the step gets done
+ * @param      step  Does one step and returns how many units it got done
+ */
+template <typename Step>
+static void _measure(char const name[], char const unit[], Step step)
+{
+    uint64_t const started = mockTime();
+    uint64_t elapsed = 0;
+    double done = 0;
+    do
+    {
+        done += step();
+        elapsed = mockTime() - started;
+    } while (elapsed < BENCH_MIN_MS * 1000ULL);
+    printf("%-32s %12.0f %s/s\n", name, done * 1e6 / elapsed, unit);
+}
+
+static void _benchEncode(char const name[], char filepath[], char filepath_encoded[])
+{
+    Storage &storage = Storage::instance();
+    File source = SD.open(filepath);
+    uint32_t const size = source.size();
+    source.close();
+    _measure(name, "bytes", [&]() {
+        storage.invalidateCache();
+        SD.remove(filepath_encoded);
+        storage.getBitmap(filepath, 0, 0);
+        return (double)size;
+    });
+}
+
+static void _benchRows(char const name[], char filepath[], uint16_t strip)
+{
+    Storage &storage = Storage::instance();
+    _measure(name, "rows", [&]() {
+        uint16_t rows = 0;
+        for (uint16_t row = 0; row < SCREEN_Y; row += strip)
+        {
+            rows += storage.getBitmap(filepath, row, strip).rows;
+        }
+        return (double)rows;
+    });
+}
+
+static bool _benchStorage()
+{
+    Storage &storage = Storage::instance();
+
+    _benchEncode("encode monochrome", _mono_path, _mono_encoded);
+    _benchEncode("encode color", _color_path, _color_encoded);
+
+    storage.invalidateCache();
+    _benchRows("decode monochrome, 40 rows", _mono_path, 40);
+    _benchRows("decode cbm from SD, 40 rows", _mono_encoded, 40);
+    // The plan is larger than the cache, so only the rows at its top are prefetched
+    if (!storage.prefetchBitmap(_mono_encoded))
+    {
+        fprintf(stderr, "Failed to prefetch %s\n", _mono_encoded);
+        return false;
+    }
+    _benchRows("decode cbm prefetched, 40 rows", _mono_encoded, 40);
+    storage.invalidateCache();
+
+    _measure("stream spans", "rows", [&]() {
+        storage.streamSpans(_mono_path, _countSpan);
+        return (double)SCREEN_Y;
+    });
+    char floor[] = "2";
+    _measure("stream floor spans", "rows", [&]() {
+        storage.streamFloorSpans(floor, _countSpan);
+        return (double)SCREEN_Y;
+    });
+
+    _measure("mapping load", "loads", [&]() {
+        storage.getMappingList(_mapping_path);
+        return 1.0;
+    });
+    uint16_t next = 0;
+    _measure("mapping lookup", "lookups", [&]() {
+        for (uint16_t i = 0; i < 1000; ++i)
+        {
+            char floor_no[8];
+            char name[30];
+            char name2[30];
+            snprintf(floor_no, sizeof(floor_no), "%u", 1 + next++ % _floors);
+            storage.getFloorMapping(floor_no, name, name2);
+        }
+        return 1000.0;
+    });
+    return true;
+}
+
+static bool _waitForLink(uint32_t started)
+{
+    while (BenchLink.available() <= 0)
+    {
+        if (millis() - started > BENCH_TRANSFER_TIMEOUT_MS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief      Uploads a file the way nodes predating NetworkFrame do
+ *
+ * The size is sent as text after 'READY', and every byte received afterwards
+ * is answered with a chunk of 200 bytes, the last one padded with stale data.
+ */
+static bool _legacyUpload(char filepath[])
+{
+    File file = SD.open(filepath);
+    uint32_t const size = file.size();
+    BenchLink.write(UPLOAD_FILE);
+    BenchLink.print(filepath);
+
+    uint32_t const started = millis();
+    if (!_waitForLink(started) || BenchLink.read() != READY)
+    {
+        return false;
+    }
+    BenchLink.print(size);
+
+    uint8_t buffer[200] = { 0 };
+    for (uint32_t i = 0; i < size; i += 200)
+    {
+        if (!_waitForLink(started))
+        {
+            return false;
+        }
+        BenchLink.read();
+        file.read(buffer, 200);
+        BenchLink.write(buffer, 200);
+    }
+    file.close();
+    return true;
+}
+
+/**
+ * @brief      Receives a pushed file from another process and prints the throughput
+ *
+ * @param      name      Name of the measurement
+ * @param      filepath  File sent, replaced by the download
+ * @param      legacy    Whether the other process uploads like a node predating NetworkFrame
+ */
+static void _benchTransfer(char const name[], char filepath[], bool legacy)
+{
+    // Keep what is sent to compare with the download that replaces it
+    File sent_file = SD.open(filepath);
+    std::vector<uint8_t> sent(sent_file.size());
+    sent_file.read(sent.data(), sent.size());
+    sent_file.close();
+
+    int link[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link) != 0)
+    {
+        perror("socketpair");
+        return;
+    }
+    pid_t const uploader = fork();
+    if (uploader == 0)
+    {
+        close(link[0]);
+        BenchLink.connect(link[1]);
+        if (legacy)
+        {
+            BenchLink.begin(BENCH_LEGACY_BAUD);
+        }
+        bool const uploaded = legacy ? _legacyUpload(filepath)
+                                     : Network::instance().uploadFile(filepath, true);
+        _exit(uploaded ? 0 : 1);
+    }
+    close(link[1]);
+    BenchLink.connect(link[0]);
+    SD.remove(filepath);
+
+    uint64_t const started = mockTime();
+    NetworkFrame frame;
+    char received_path[50];
+    bool const received = Network::instance().receiveCommand(frame, received_path, sizeof(received_path)) &&
+                          Network::instance().downloadFile(received_path, true);
+    uint64_t const elapsed = mockTime() - started;
+
+    // The uploader may still wait for the confirmation of an older receiver
+    uint32_t const dropped = BenchLink.getDropped();
+    kill(uploader, SIGTERM);
+    waitpid(uploader, nullptr, 0);
+    BenchLink.connect(-1);
+    close(link[0]);
+
+    File received_file = SD.open(filepath);
+    std::vector<uint8_t> saved(received_file.size());
+    received_file.read(saved.data(), saved.size());
+    received_file.close();
+    bool const intact = received && saved == sent;
+    printf("%-32s %12.0f bytes/s, %s, %u bytes dropped\n", name, sent.size() * 1e6 / elapsed,
+           intact ? "intact" : "FAILED", dropped);
+
+    // Later measurements send the same file again
+    if (!intact)
+    {
+        File restored = SD.open(filepath, FILE_WRITE | O_TRUNC);
+        restored.write(sent.data(), sent.size());
+        restored.close();
+    }
+}
+
+int main()
+{
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+#ifdef SCANLINE_SELFTEST
+    if (!scanlineSelfTest())
+    {
+        fprintf(stderr, "Scanline self test failed\n");
+        return 1;
+    }
+    printf("Scanline self test passed\n");
+#endif
+    // Fixtures and the start of Storage are not measured
+    SD.setTiming(false);
+    SD.begin(SD_CHIP_SELECT_PIN);
+    fixtureSeed(BENCH_SEED);
+    fixtureMonoBitmap(_mono_path, SCREEN_X, SCREEN_Y, 24);
+    fixtureMonoBitmap(_overlay_path, SCREEN_X, SCREEN_Y, 8);
+    fixtureColorBitmap(_color_path, SCREEN_X, SCREEN_Y, 24);
+    fixtureMappingText(_text_path, _floors, "plan");
+    fixtureData(_transfer_path, BENCH_TRANSFER_SIZE);
+
+    Storage &storage = Storage::instance();
+    if (storage.importMappingList(_text_path) != 0 || storage.commitMappingList(_mapping_path) != 0)
+    {
+        fprintf(stderr, "Failed to set up the mapping\n");
+        return 1;
+    }
+    if (!Network::instance().begin())
+    {
+        fprintf(stderr, "Failed to set up the link\n");
+        return 1;
+    }
+    SD.setTiming(true);
+
+    if (!_benchStorage())
+    {
+        return 1;
+    }
+    _benchTransfer("transfer", _transfer_path, false);
+    _benchTransfer("transfer from legacy node", _transfer_path, true);
+    // The size sent as text is followed right away by the first digit of the mapping
+    _benchTransfer("transfer text from legacy node", _text_path, true);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <vector>
+
+#include "Fixtures.h"
+#include "SdFat.h"
+
+extern MockSdFat SD;
+
+static uint32_t _state = 1;
+
+void fixtureSeed(uint32_t seed)
+{
+    _state = seed;
+}
+
+/**
+ * @brief      Gets the next number of a linear congruential generator
+ *
+ * @param[in]  range  Numbers are below range
+ */
+static uint32_t _next(uint32_t range)
+{
+    _state = _state * 1103525245 + 12345;
+    return ((_state >> 8) & 0xFFFFFF) % range;
+}
+
+static void _put16(std::vector<uint8_t> &data, uint32_t offset, uint16_t value)
+{
+    data[offset] = value;
+    data[offset + 1] = value >> 8;
+}
+
+static void _put32(std::vector<uint8_t> &data, uint32_t offset, uint32_t value)
+{
+    _put16(data, offset, value);
+    _put16(data, offset + 2, value >> 16);
+}
+
+/**
+ * @brief      Fills the BITMAPFILEHEADER and BITMAPINFOHEADER of an uncompressed bitmap
+ */
+static void _header(std::vector<uint8_t> &data, uint32_t offset, uint16_t width, uint16_t height,
+                    uint16_t bits_per_pixel)
+{
+    data[0] = 'B';
+    data[1] = 'M';
+    _put32(data, 2, data.size());
+    _put32(data, 10, offset);
+    _put32(data, 14, 40);
+    _put32(data, 18, width);
+    _put32(data, 22, height);
+    _put16(data, 26, 1);
+    _put16(data, 28, bits_per_pixel);
+}
+
+static uint32_t _save(char const path[], std::vector<uint8_t> const &data)
+{
+    SD.remove(path);
+    File file = SD.open(path, FILE_WRITE);
+    if (!file)
+    {
+        fprintf(stderr, "Failed to create fixture %s\n", path);
+        return 0;
+    }
+    file.write(data.data(), data.size());
+    file.close();
+    return data.size();
+}
+
+typedef struct s_room
+{
+    uint16_t left;
+    uint16_t top;
+    uint16_t right; // Exclusive
+    uint16_t bottom; // Exclusive
+    bool filled;
+    uint8_t color;
+} Room;
+
+static std::vector<Room> _rooms(uint16_t width, uint16_t height, uint8_t count)
+{
+    std::vector<Room> rooms;
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        Room room;
+        room.left = _next(width - 8);
+        room.top = _next(height - 8);
+        room.right = min((uint32_t)width, room.left + 8 + _next(width / 3));
+        room.bottom = min((uint32_t)height, room.top + 8 + _next(height / 3));
+        room.filled = _next(4) == 0;
+        room.color = _next(5);
+        rooms.push_back(room);
+    }
+    return rooms;
+}
+
+static bool _covers(Room const &room, uint16_t x, uint16_t y)
+{
+    if (x < room.left || x >= room.right || y < room.top || y >= room.bottom)
+    {
+        return false;
+    }
+    // Walls are two pixels thick
+    return room.filled || x < room.left + 2 || x >= room.right - 2 || y < room.top + 2 || y >= room.bottom - 2;
+}
+
+uint32_t fixtureMonoBitmap(char const path[], uint16_t width, uint16_t height, uint8_t rooms)
+{
+    uint32_t const stride = (width + 31) / 32 * 4;
+    std::vector<uint8_t> data(62 + stride * height, 0);
+    _header(data, 62, width, height, 1);
+    _put32(data, 58, 0xFFFFFF);
+
+    std::vector<Room> const plan = _rooms(width, height, rooms);
+    for (uint16_t y = 0; y < height; ++y)
+    {
+        for (uint16_t x = 0; x < width; ++x)
+        {
+            for (size_t i = 0; i < plan.size(); ++i)
+            {
+                if (_covers(plan[i], x, y))
+                {
+                    data[62 + y * stride + x / 8] |= 0x80 >> (x % 8);
+                    break;
+                }
+            }
+        }
+    }
+    return _save(path, data);
+}
+
+uint32_t fixtureColorBitmap(char const path[], uint16_t width, uint16_t height, uint8_t rooms)
+{
+    static uint8_t const palette[5][3] = {
+        { 0x20, 0x20, 0x20 }, { 0xC0, 0x40, 0x40 }, { 0x40, 0xA0, 0x40 }, { 0x40, 0x60, 0xD0 }, { 0xE0, 0xC0, 0x30 }
+    };
+    uint32_t const stride = ((uint32_t)width * 3 + 3) / 4 * 4;
+    std::vector<uint8_t> data(54 + stride * height, 0);
+    _header(data, 54, width, height, 24);
+
+    std::vector<Room> const plan = _rooms(width, height, rooms);
+    for (uint16_t y = 0; y < height; ++y)
+    {
+        for (uint16_t x = 0; x < width; ++x)
+        {
+            uint8_t const *pixel = nullptr;
+            for (size_t i = 0; i < plan.size() && pixel == nullptr; ++i)
+            {
+                if (_covers(plan[i], x, y))
+                {
+                    pixel = palette[plan[i].color];
+                }
+            }
+            uint8_t *into = &data[54 + y * stride + x * 3];
+            into[0] = pixel ? pixel[2] : 0xFF;
+            into[1] = pixel ? pixel[1] : 0xFF;
+            into[2] = pixel ? pixel[0] : 0xFF;
+        }
+    }
+    return _save(path, data);
+}
+
+uint32_t fixtureMappingText(char const path[], uint16_t floors, char const prefix[])
+{
+    std::vector<uint8_t> data;
+    for (uint16_t floor = 1; floor <= floors; ++floor)
+    {
+        char line[64];
+        int const length = floor % 2 == 0
+            ? snprintf(line, sizeof(line), "%u,%s%u.bmp,%s%u_o.bmp\n", floor, prefix, floor, prefix, floor)
+            : snprintf(line, sizeof(line), "%u,%s%u.bmp,\n", floor, prefix, floor);
+        data.insert(data.end(), line, line + length);
+    }
+    data.push_back('$');
+    data.push_back('\n');
+    return _save(path, data);
+}
+
+uint32_t fixtureData(char const path[], uint32_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        data[i] = _next(256);
+    }
+    return _save(path, data);
+}
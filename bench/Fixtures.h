@@ -0,0 +1,24 @@
+#ifndef Fixtures_h
+#define Fixtures_h
+
+#include <stdint.h>
+
+// Files of the benchmark, generated from a seed so that every run measures the same data.
+// Each returns the size of the file written, 0 on failure.
+
+// Restarts the sequence of generated content
+void fixtureSeed(uint32_t seed);
+
+// Monochrome floor plan: outlined rooms with a few filled areas, at 1 bit per pixel
+uint32_t fixtureMonoBitmap(char const path[], uint16_t width, uint16_t height, uint8_t rooms);
+
+// Color floor plan: rooms filled with one of a few colors over white, at 24 bits per pixel
+uint32_t fixtureColorBitmap(char const path[], uint16_t width, uint16_t height, uint8_t rooms);
+
+// Mapping in text format, floor n mapped to "<prefix>n.bmp" and every other floor also to an overlay
+uint32_t fixtureMappingText(char const path[], uint16_t floors, char const prefix[]);
+
+// Bytes without structure, as sent over the link
+uint32_t fixtureData(char const path[], uint32_t size);
+
+#endif
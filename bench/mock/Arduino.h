@@ -0,0 +1,99 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Host stand-in for the parts of the Arduino core used by Storage and Network
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(uint8_t const *)(address))
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Time of this node in microseconds: the CPU time it has spent plus the time it has waited
+// for peripherals, which the mocks add with mockWait. CPU time the mocks spend on the host,
+// such as talking to other processes, is taken back out with mockExclude. Forked processes
+// go on from the time of their parent, then nodes in other processes keep their own time,
+// see MockUart.
+uint64_t mockTime();
+void mockWait(uint64_t us);
+void mockExclude(uint64_t us);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+char *ultoa(unsigned long value, char buffer[], int base);
+char *utoa(unsigned int value, char buffer[], int base);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(uint8_t const buffer[], size_t size);
+    size_t write(char const text[]);
+    size_t write(int c) { return write((uint8_t)c); }
+    size_t write(unsigned int c) { return write((uint8_t)c); }
+    size_t write(long c) { return write((uint8_t)c); }
+    size_t write(unsigned long c) { return write((uint8_t)c); }
+    size_t print(char const text[]);
+    size_t print(char c);
+    size_t print(int value, int base = 10);
+    size_t print(unsigned int value, int base = 10);
+    size_t print(long value, int base = 10);
+    size_t print(unsigned long value, int base = 10);
+    size_t println();
+    size_t println(char const text[]);
+    size_t println(char c);
+    size_t println(int value, int base = 10);
+    size_t println(unsigned int value, int base = 10);
+    size_t println(long value, int base = 10);
+    size_t println(unsigned long value, int base = 10);
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    virtual void begin(unsigned long baud_rate) {}
+    virtual int availableForWrite() { return 63; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t c) override;
+    using Print::write;
+};
+
+// Serial goes to stderr when BENCH_VERBOSE is set, Serial1 is left unconnected
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#include "MockUart.h"
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef Config_h
+#define Config_h
+
+// Pins and screen of the benchmark build, matching the device
+
+#define SOFT_MISO_PIN 12
+#define SOFT_MOSI_PIN 11
+#define SOFT_SCK_PIN 13
+#define SD_CHIP_SELECT_PIN 10
+
+#define SCREEN_X 480
+#define SCREEN_Y 272
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef Display_h
+#define Display_h
+
+#include <stdint.h>
+
+// Display of the benchmark build, which draws nothing
+
+class Display
+{
+public:
+    static Display& instance()
+    {
+        static Display display;
+        return display;
+    }
+    void clear() {}
+    void renderText(char const text[], int16_t x, int16_t y) {}
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "Arduino.h"
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+static uint8_t _pins[64];
+/** @brief Time spent waiting for peripherals, in microseconds */
+static uint64_t _waited;
+static uint64_t _excluded;
+/** @brief Processor time of the parent when forked, as the processor time of a child starts at 0 */
+static uint64_t _inherited;
+static uint64_t _forking;
+
+static uint64_t _processorTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void _beforeFork()
+{
+    _forking = _processorTime();
+}
+
+static void _inChild()
+{
+    _inherited += _forking;
+}
+
+static int const _fork_handlers = pthread_atfork(_beforeFork, nullptr, _inChild);
+
+uint64_t mockTime()
+{
+    return _processorTime() + _inherited + _waited - _excluded;
+}
+
+void mockWait(uint64_t us)
+{
+    _waited += us;
+}
+
+void mockExclude(uint64_t us)
+{
+    _excluded += us;
+}
+
+unsigned long millis()
+{
+    return mockTime() / 1000;
+}
+
+unsigned long micros()
+{
+    return mockTime();
+}
+
+void delay(unsigned long ms)
+{
+    mockWait((uint64_t)ms * 1000);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    _pins[pin % 64] = value;
+}
+
+int digitalRead(uint8_t pin)
+{
+    return _pins[pin % 64];
+}
+
+char *ultoa(unsigned long value, char buffer[], int base)
+{
+    sprintf(buffer, base == 16 ? "%lx" : "%lu", value);
+    return buffer;
+}
+
+char *utoa(unsigned int value, char buffer[], int base)
+{
+    return ultoa(value, buffer, base);
+}
+
+size_t Print::write(uint8_t const buffer[], size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        write(buffer[i]);
+    }
+    return size;
+}
+
+size_t Print::write(char const text[])
+{
+    return write((uint8_t const *)text, strlen(text));
+}
+
+size_t Print::print(char const text[])
+{
+    return write(text);
+}
+
+size_t Print::print(char c)
+{
+    return write((uint8_t)c);
+}
+
+size_t Print::print(int value, int base)
+{
+    return print((long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base)
+{
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(long value, int base)
+{
+    char text[24];
+    snprintf(text, sizeof(text), base == 16 ? "%lx" : "%ld", value);
+    return print(text);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+    char text[24];
+    snprintf(text, sizeof(text), base == 16 ? "%lx" : "%lu", value);
+    return print(text);
+}
+
+size_t Print::println()
+{
+    return print("\r\n");
+}
+
+size_t Print::println(char const text[])
+{
+    return print(text) + println();
+}
+
+size_t Print::println(char c)
+{
+    return print(c) + println();
+}
+
+size_t Print::println(int value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned int value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(long value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    static bool const verbose = getenv("BENCH_VERBOSE") != nullptr;
+    if (verbose && this == &Serial)
+    {
+        fputc(c, stderr);
+    }
+    return 1;
+}
@@ -0,0 +1,715 @@
+#include <ctype.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SdFat.h"
+
+#define MOCK_SD_BLOCK_SIZE 512
+// Directory entries in a block of a directory
+#define MOCK_SD_DIR_ENTRIES 16
+
+struct MockSdNode
+{
+    std::string name;
+    std::string key;
+    bool directory;
+    bool removed;
+    std::vector<uint8_t> data;
+    /** @brief Children of a directory by their entry index, null where one was removed */
+    std::vector<MockSdNode *> slots;
+    uint16_t slot;
+    /** @brief Bytes backed by clusters, which are in one run on the card for contiguous files */
+    uint32_t allocated;
+    bool contiguous;
+    uint32_t first_block;
+    uint32_t modified;
+    bool written;
+};
+
+static std::map<std::string, MockSdNode *> _nodes;
+static MockSdNode *_root;
+static FatFile _root_file;
+static SdSpiCard _card;
+static bool _timing = true;
+static uint32_t _next_block = 0x10000;
+static uint32_t _stamp = 0x4A210000;
+
+/** @brief Block held by the single block cache of the volume */
+static MockSdNode *_cache_node;
+static uint32_t _cache_block;
+static bool _cache_dirty;
+
+/** @brief Contiguous file open for raw writes, and its next block */
+static MockSdNode *_raw_node;
+static uint32_t _raw_block;
+static uint32_t _raw_end;
+
+/**
+ * @brief      Keeps the card busy for the given time
+ *
+ * @param[in]  us    Time in microseconds
+ */
+static void _busy(uint32_t us)
+{
+    if (_timing)
+    {
+        mockWait(us);
+    }
+}
+
+/**
+ * @brief      Gets the key of a path, relative paths starting at the root
+ *
+ * FAT names are case insensitive, and a trailing slash names the same directory.
+ */
+static std::string _key(char const path[])
+{
+    std::string key = path[0] == '/' ? "" : "/";
+    for (char const *c = path; *c != '\0'; ++c)
+    {
+        key += tolower(*c);
+    }
+    while (key.size() > 1 && key[key.size() - 1] == '/')
+    {
+        key.erase(key.size() - 1);
+    }
+    return key;
+}
+
+static std::string _parentKey(std::string const &key)
+{
+    size_t const slash = key.rfind('/');
+    return slash == 0 ? "/" : key.substr(0, slash);
+}
+
+static MockSdNode *_find(std::string const &key)
+{
+    std::map<std::string, MockSdNode *>::iterator const found = _nodes.find(key);
+    return found == _nodes.end() ? nullptr : found->second;
+}
+
+static MockSdNode *_create(char const path[], bool directory)
+{
+    std::string const key = _key(path);
+    MockSdNode *parent = _find(_parentKey(key));
+    if (parent == nullptr || !parent->directory || _find(key) != nullptr)
+    {
+        return nullptr;
+    }
+
+    MockSdNode *node = new MockSdNode();
+    std::string const shown = path;
+    node->name = shown.substr(shown.rfind('/') + 1);
+    node->key = key;
+    node->directory = directory;
+    node->removed = false;
+    node->allocated = 0;
+    node->contiguous = false;
+    node->first_block = 0;
+    node->modified = _stamp++;
+    node->written = false;
+    node->slot = parent->slots.size();
+    parent->slots.push_back(node);
+    if (parent->slots.size() % MOCK_SD_DIR_ENTRIES == 0)
+    {
+        // Directory grows into another cluster
+        _busy(MOCK_SD_CLUSTER_US);
+    }
+    _busy(MOCK_SD_BLOCK_WRITE_US);
+    _nodes[key] = node;
+    return node;
+}
+
+static void _unlink(MockSdNode *node)
+{
+    _nodes.erase(node->key);
+    _find(_parentKey(node->key))->slots[node->slot] = nullptr;
+}
+
+/**
+ * @brief      Writes the cached block back if it is dirty
+ */
+static void _flushCache()
+{
+    if (_cache_dirty)
+    {
+        _busy(MOCK_SD_BLOCK_WRITE_US);
+        _cache_dirty = false;
+    }
+}
+
+/**
+ * @brief      Brings a block of a file into the cache
+ *
+ * @param      node   The file
+ * @param[in]  block  Block within the file
+ * @param[in]  load   Whether the block holds data to read first
+ */
+static void _cacheBlock(MockSdNode *node, uint32_t block, bool load)
+{
+    if (_cache_node == node && _cache_block == block)
+    {
+        return;
+    }
+    _flushCache();
+    if (load)
+    {
+        _busy(MOCK_SD_BLOCK_READ_US);
+    }
+    _cache_node = node;
+    _cache_block = block;
+}
+
+static MockSdNode *_rootNode()
+{
+    if (_root == nullptr)
+    {
+        _root = new MockSdNode();
+        _root->name = "/";
+        _root->key = "/";
+        _root->directory = true;
+        _root->removed = false;
+        _nodes["/"] = _root;
+    }
+    return _root;
+}
+
+FatFile::FatFile()
+{
+    this->node = nullptr;
+    this->pos = 0;
+    this->mode = 0;
+    this->next_index = 0;
+}
+
+bool FatFile::open(FatFile *directory, char const path[], uint8_t mode)
+{
+    std::string full = path;
+    if (directory != nullptr && directory->node != nullptr && directory->node != _root && path[0] != '/')
+    {
+        full = directory->node->key + "/" + full;
+    }
+    this->node = nullptr;
+    _busy(MOCK_SD_OPEN_US);
+
+    MockSdNode *node = _find(_key(full.c_str()));
+    if (node == nullptr)
+    {
+        if (!(mode & O_CREAT) || !(mode & O_WRITE))
+        {
+            return false;
+        }
+        node = _create(full.c_str(), false);
+        if (node == nullptr)
+        {
+            return false;
+        }
+    }
+    else if ((mode & O_CREAT) && (mode & O_EXCL))
+    {
+        return false;
+    }
+    else if (node->directory && (mode & O_WRITE))
+    {
+        return false;
+    }
+
+    if ((mode & O_TRUNC) && (mode & O_WRITE))
+    {
+        node->data.clear();
+        node->allocated = 0;
+        node->contiguous = false;
+        node->written = true;
+    }
+    this->node = node;
+    this->mode = mode;
+    this->pos = (mode & O_AT_END) ? node->data.size() : 0;
+    this->next_index = 0;
+    return true;
+}
+
+bool FatFile::open(FatFile *directory, uint16_t index, uint8_t mode)
+{
+    if (directory == nullptr || directory->node == nullptr || !directory->node->directory ||
+        index >= directory->node->slots.size() || directory->node->slots[index] == nullptr)
+    {
+        return false;
+    }
+    _busy(MOCK_SD_BLOCK_READ_US);
+    this->node = directory->node->slots[index];
+    this->pos = 0;
+    this->mode = mode;
+    this->next_index = 0;
+    return true;
+}
+
+bool FatFile::createContiguous(FatFile *directory, char const path[], uint32_t size)
+{
+    std::string full = path;
+    if (directory != nullptr && directory->node != nullptr && directory->node != _root && path[0] != '/')
+    {
+        full = directory->node->key + "/" + full;
+    }
+    MockSdNode *node = _create(full.c_str(), false);
+    if (node == nullptr || size == 0)
+    {
+        return false;
+    }
+
+    // One search of the FAT and one update for the whole run
+    _busy(MOCK_SD_CLUSTER_US);
+    node->data.assign(size, 0);
+    node->allocated = (size + MOCK_SD_CLUSTER_SIZE - 1) / MOCK_SD_CLUSTER_SIZE * MOCK_SD_CLUSTER_SIZE;
+    node->contiguous = true;
+    node->first_block = _next_block;
+    node->written = true;
+    _next_block += node->allocated / MOCK_SD_BLOCK_SIZE;
+    this->node = node;
+    this->pos = 0;
+    this->mode = O_RDWR;
+    this->next_index = 0;
+    return true;
+}
+
+bool FatFile::contiguousRange(uint32_t *first_block, uint32_t *last_block)
+{
+    if (this->node == nullptr || !this->node->contiguous)
+    {
+        return false;
+    }
+    *first_block = this->node->first_block;
+    *last_block = this->node->first_block + (this->node->data.size() - 1) / MOCK_SD_BLOCK_SIZE;
+    return true;
+}
+
+bool FatFile::dirEntry(dir_t *entry)
+{
+    if (this->node == nullptr)
+    {
+        return false;
+    }
+    entry->lastWriteDate = this->node->modified >> 16;
+    entry->lastWriteTime = this->node->modified & 0xFFFF;
+    entry->fileSize = this->node->data.size();
+    return true;
+}
+
+uint16_t FatFile::dirIndex()
+{
+    return this->node == nullptr ? 0 : this->node->slot;
+}
+
+bool FatFile::isDir() const
+{
+    return this->node != nullptr && this->node->directory;
+}
+
+bool FatFile::isOpen() const
+{
+    return this->node != nullptr;
+}
+
+bool FatFile::truncate(uint32_t length)
+{
+    if (this->node == nullptr || this->node->directory || !(this->mode & O_WRITE) ||
+        length > this->node->data.size())
+    {
+        return false;
+    }
+    this->node->data.resize(length);
+    this->node->allocated = (length + MOCK_SD_CLUSTER_SIZE - 1) / MOCK_SD_CLUSTER_SIZE * MOCK_SD_CLUSTER_SIZE;
+    this->node->written = true;
+    this->pos = min(this->pos, length);
+    if (_cache_node == this->node && _cache_block * MOCK_SD_BLOCK_SIZE >= length)
+    {
+        _cache_node = nullptr;
+        _cache_dirty = false;
+    }
+    // Frees the clusters after the end
+    _busy(MOCK_SD_BLOCK_WRITE_US);
+    return true;
+}
+
+bool FatFile::sync()
+{
+    if (this->node == nullptr)
+    {
+        return false;
+    }
+    if (_cache_node == this->node)
+    {
+        _flushCache();
+    }
+    if (this->node->written)
+    {
+        // Directory entry with the new size and time
+        _busy(MOCK_SD_BLOCK_WRITE_US);
+        this->node->modified = _stamp++;
+        this->node->written = false;
+    }
+    return true;
+}
+
+bool FatFile::close()
+{
+    bool const synced = this->sync();
+    this->node = nullptr;
+    return synced;
+}
+
+File::operator bool() const
+{
+    return this->isOpen();
+}
+
+bool File::seek(uint32_t position)
+{
+    if (this->node == nullptr || position > this->node->data.size())
+    {
+        return false;
+    }
+    this->pos = position;
+    return true;
+}
+
+bool File::seekEnd(int32_t offset)
+{
+    if (this->node == nullptr)
+    {
+        return false;
+    }
+    return this->seek(this->node->data.size() + offset);
+}
+
+uint32_t File::position()
+{
+    return this->pos;
+}
+
+uint32_t File::size()
+{
+    return this->node == nullptr ? 0 : this->node->data.size();
+}
+
+int File::available()
+{
+    if (this->node == nullptr || this->node->directory)
+    {
+        return 0;
+    }
+    return min(this->node->data.size() - this->pos, (size_t)0x7FFF);
+}
+
+int File::read()
+{
+    uint8_t c;
+    return this->read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek()
+{
+    uint32_t const position = this->pos;
+    int const c = this->read();
+    this->pos = position;
+    return c;
+}
+
+int File::read(void *buffer, size_t amount)
+{
+    if (this->node == nullptr || this->node->directory || !(this->mode & O_READ))
+    {
+        return -1;
+    }
+
+    uint8_t *into = (uint8_t *)buffer;
+    size_t done = 0;
+    while (done < amount && this->pos < this->node->data.size())
+    {
+        uint32_t const block = this->pos / MOCK_SD_BLOCK_SIZE;
+        uint16_t const offset = this->pos % MOCK_SD_BLOCK_SIZE;
+        size_t const length = min(min((size_t)(MOCK_SD_BLOCK_SIZE - offset), amount - done),
+                                  this->node->data.size() - this->pos);
+        if (offset == 0 && length == MOCK_SD_BLOCK_SIZE &&
+            !(_cache_node == this->node && _cache_block == block))
+        {
+            // Whole blocks go straight from the card into the buffer
+            _busy(MOCK_SD_BLOCK_READ_US);
+        }
+        else
+        {
+            _cacheBlock(this->node, block, true);
+        }
+        memcpy(into + done, this->node->data.data() + this->pos, length);
+        this->pos += length;
+        done += length;
+    }
+    return done;
+}
+
+size_t File::write(uint8_t c)
+{
+    return this->write(&c, 1);
+}
+
+size_t File::write(uint8_t const buffer[], size_t size)
+{
+    if (this->node == nullptr || this->node->directory || !(this->mode & O_WRITE))
+    {
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        uint32_t const block = this->pos / MOCK_SD_BLOCK_SIZE;
+        uint16_t const offset = this->pos % MOCK_SD_BLOCK_SIZE;
+        size_t const length = min((size_t)(MOCK_SD_BLOCK_SIZE - offset), size - done);
+        bool const existing = (uint32_t)block * MOCK_SD_BLOCK_SIZE < this->node->data.size();
+        if (this->pos + length > this->node->data.size())
+        {
+            this->node->data.resize(this->pos + length);
+            while (this->node->data.size() > this->node->allocated)
+            {
+                this->node->allocated += MOCK_SD_CLUSTER_SIZE;
+                _busy(MOCK_SD_CLUSTER_US);
+            }
+        }
+        if (offset == 0 && length == MOCK_SD_BLOCK_SIZE)
+        {
+            // Whole blocks go straight from the buffer onto the card
+            if (_cache_node == this->node && _cache_block == block)
+            {
+                _cache_node = nullptr;
+                _cache_dirty = false;
+            }
+            _busy(MOCK_SD_BLOCK_WRITE_US);
+        }
+        else
+        {
+            _cacheBlock(this->node, block, existing);
+            _cache_dirty = true;
+        }
+        memcpy(this->node->data.data() + this->pos, buffer + done, length);
+        this->pos += length;
+        done += length;
+    }
+    this->node->written = true;
+    return done;
+}
+
+void File::flush()
+{
+    this->sync();
+}
+
+bool File::getName(char name[], size_t size)
+{
+    if (this->node == nullptr || size == 0)
+    {
+        return false;
+    }
+    strncpy(name, this->node->name.c_str(), size - 1);
+    name[size - 1] = '\0';
+    return true;
+}
+
+bool File::isDirectory()
+{
+    return this->isDir();
+}
+
+File File::openNextFile(uint8_t mode)
+{
+    File next;
+    if (this->node == nullptr || !this->node->directory)
+    {
+        return next;
+    }
+    while (this->next_index < this->node->slots.size())
+    {
+        uint16_t const index = this->next_index++;
+        if (index % MOCK_SD_DIR_ENTRIES == 0)
+        {
+            _busy(MOCK_SD_BLOCK_READ_US);
+        }
+        if (this->node->slots[index] != nullptr)
+        {
+            next.node = this->node->slots[index];
+            next.mode = mode;
+            return next;
+        }
+    }
+    return next;
+}
+
+void File::rewindDirectory()
+{
+    this->next_index = 0;
+}
+
+void File::close()
+{
+    FatFile::close();
+}
+
+bool SdSpiCard::writeStart(uint32_t block, uint32_t count)
+{
+    for (std::map<std::string, MockSdNode *>::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+    {
+        MockSdNode *node = i->second;
+        if (node->contiguous && block >= node->first_block &&
+            block + count <= node->first_block + node->allocated / MOCK_SD_BLOCK_SIZE)
+        {
+            _busy(MOCK_SD_BLOCK_WRITE_US);
+            _raw_node = node;
+            _raw_block = block;
+            _raw_end = block + count;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SdSpiCard::writeData(uint8_t const data[])
+{
+    if (_raw_node == nullptr || _raw_block >= _raw_end)
+    {
+        return false;
+    }
+    uint32_t const block = _raw_block - _raw_node->first_block;
+    uint32_t const offset = block * MOCK_SD_BLOCK_SIZE;
+    if (offset < _raw_node->data.size())
+    {
+        memcpy(_raw_node->data.data() + offset, data,
+               min((size_t)MOCK_SD_BLOCK_SIZE, _raw_node->data.size() - offset));
+    }
+    if (_cache_node == _raw_node && _cache_block == block)
+    {
+        _cache_node = nullptr;
+        _cache_dirty = false;
+    }
+    _busy(MOCK_SD_RAW_BLOCK_US);
+    _raw_block++;
+    return true;
+}
+
+bool SdSpiCard::writeStop()
+{
+    bool const writing = _raw_node != nullptr;
+    _raw_node = nullptr;
+    return writing;
+}
+
+bool MockSdFat::begin(uint8_t chip_select)
+{
+    _rootNode();
+    return true;
+}
+
+File MockSdFat::open(char const path[], uint8_t mode)
+{
+    _rootNode();
+    File opened;
+    opened.open(nullptr, path, mode);
+    return opened;
+}
+
+bool MockSdFat::exists(char const path[])
+{
+    _rootNode();
+    _busy(MOCK_SD_OPEN_US);
+    return _find(_key(path)) != nullptr;
+}
+
+bool MockSdFat::mkdir(char const path[], bool parents)
+{
+    _rootNode();
+    std::string const key = _key(path);
+    if (_find(key) != nullptr)
+    {
+        return false;
+    }
+    if (parents && _find(_parentKey(key)) == nullptr)
+    {
+        this->mkdir(_parentKey(key).c_str(), true);
+    }
+    return _create(key.c_str(), true) != nullptr;
+}
+
+bool MockSdFat::remove(char const path[])
+{
+    _rootNode();
+    MockSdNode *node = _find(_key(path));
+    if (node == nullptr || node->directory)
+    {
+        return false;
+    }
+    _busy(MOCK_SD_OPEN_US + MOCK_SD_BLOCK_WRITE_US);
+    _unlink(node);
+    node->removed = true;
+    if (_cache_node == node)
+    {
+        _cache_node = nullptr;
+        _cache_dirty = false;
+    }
+    return true;
+}
+
+bool MockSdFat::rename(char const old_path[], char const new_path[])
+{
+    _rootNode();
+    MockSdNode *node = _find(_key(old_path));
+    std::string const key = _key(new_path);
+    MockSdNode *parent = _find(_parentKey(key));
+    if (node == nullptr || node->directory || _find(key) != nullptr || parent == nullptr)
+    {
+        return false;
+    }
+
+    // A new entry is made before the old one is freed
+    _busy(MOCK_SD_OPEN_US + 2 * MOCK_SD_BLOCK_WRITE_US);
+    _unlink(node);
+    std::string const shown = new_path;
+    node->name = shown.substr(shown.rfind('/') + 1);
+    node->key = key;
+    node->slot = parent->slots.size();
+    parent->slots.push_back(node);
+    _nodes[key] = node;
+    return true;
+}
+
+FatFile *MockSdFat::vwd()
+{
+    _root_file.node = _rootNode();
+    _root_file.mode = O_READ;
+    return &_root_file;
+}
+
+SdSpiCard *MockSdFat::card()
+{
+    return &_card;
+}
+
+void MockSdFat::format()
+{
+    _rootNode();
+    for (std::map<std::string, MockSdNode *>::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+    {
+        if (i->second != _root)
+        {
+            i->second->removed = true;
+        }
+    }
+    _nodes.clear();
+    _nodes["/"] = _root;
+    _root->slots.clear();
+    _cache_node = nullptr;
+    _cache_dirty = false;
+    _raw_node = nullptr;
+}
+
+void MockSdFat::setTiming(bool timing)
+{
+    _timing = timing;
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "Arduino.h"
+
+MockUart BenchLink;
+
+// Every packet on the socket starts with the link time it was sent at and the amount of bytes.
+// Link times are kept in nanoseconds, so that byte times add up exactly enough.
+#define MOCK_UART_HEADER 10
+
+MockUart::MockUart()
+{
+    this->socket = -1;
+    this->baud_rate = 9600;
+    this->pending = nullptr;
+    this->pending_sent = nullptr;
+    this->pending_capacity = 0;
+    connect(-1);
+}
+
+void MockUart::connect(int socket)
+{
+    this->socket = socket;
+    this->origin = mockTime();
+    this->peer_time = 0;
+    this->published = 0;
+    this->tx_free = 0;
+    this->ring_head = 0;
+    this->ring_count = 0;
+    this->pending_head = 0;
+    this->pending_count = 0;
+    this->packet_length = 0;
+    this->line_free = 0;
+    this->command_length = 0;
+    this->dropped = 0;
+}
+
+void MockUart::begin(unsigned long baud_rate)
+{
+    this->baud_rate = baud_rate;
+}
+
+uint64_t MockUart::now()
+{
+    return (mockTime() - this->origin) * 1000;
+}
+
+uint64_t MockUart::byteTime()
+{
+    // Start bit, 8 data bits and a stop bit
+    return 10000000000ULL / this->baud_rate;
+}
+
+/**
+ * @brief      Sends bytes to the other node, or only the time of this node if there are none
+ *
+ * @param[in]  time    Link time the first byte leaves at
+ * @param[in]  data    The bytes
+ * @param[in]  length  Amount of bytes, at most 1024
+ */
+void MockUart::sendPacket(uint64_t time, uint8_t const data[], uint16_t length)
+{
+    uint8_t packet[MOCK_UART_HEADER + 1024];
+    memcpy(packet, &time, 8);
+    memcpy(packet + 8, &length, 2);
+    memcpy(packet + MOCK_UART_HEADER, data, length);
+    for (size_t written = 0; written < MOCK_UART_HEADER + (size_t)length;)
+    {
+        ssize_t const amount = send(this->socket, packet + written, MOCK_UART_HEADER + length - written, MSG_NOSIGNAL);
+        if (amount < 0 && errno != EINTR)
+        {
+            // Other node is gone
+            return;
+        }
+        written += amount < 0 ? 0 : amount;
+    }
+}
+
+/**
+ * @brief      Collects the bytes and times the other node has sent
+ *
+ * @param[in]  wait  Whether to wait until anything arrives
+ */
+void MockUart::receive(bool wait)
+{
+    for (;;)
+    {
+        ssize_t const amount = recv(this->socket, this->packet + this->packet_length,
+                                    sizeof(this->packet) - this->packet_length, wait ? 0 : MSG_DONTWAIT);
+        if (amount == 0)
+        {
+            // Other node is gone and will never send anything earlier than now
+            this->peer_time = UINT64_MAX;
+            return;
+        }
+        if (amount < 0)
+        {
+            return;
+        }
+        this->packet_length += amount;
+
+        while (this->packet_length >= MOCK_UART_HEADER)
+        {
+            uint64_t sent;
+            uint16_t length;
+            memcpy(&sent, this->packet, 8);
+            memcpy(&length, this->packet + 8, 2);
+            if (this->packet_length < MOCK_UART_HEADER + length)
+            {
+                break;
+            }
+            this->peer_time = max(this->peer_time, sent);
+
+            if (this->pending_count + length > this->pending_capacity)
+            {
+                // Keep the pending bytes in order at the start of larger buffers
+                uint32_t const capacity = (this->pending_count + length) * 2;
+                uint8_t *bytes = new uint8_t[capacity];
+                uint64_t *times = new uint64_t[capacity];
+                for (uint32_t i = 0; i < this->pending_count; ++i)
+                {
+                    uint32_t const from = (this->pending_head + i) % this->pending_capacity;
+                    bytes[i] = this->pending[from];
+                    times[i] = this->pending_sent[from];
+                }
+                delete[] this->pending;
+                delete[] this->pending_sent;
+                this->pending = bytes;
+                this->pending_sent = times;
+                this->pending_head = 0;
+                this->pending_capacity = capacity;
+            }
+            for (uint16_t i = 0; i < length; ++i)
+            {
+                uint32_t const to = (this->pending_head + this->pending_count) % this->pending_capacity;
+                this->pending[to] = this->packet[MOCK_UART_HEADER + i];
+                this->pending_sent[to] = sent;
+                this->pending_count++;
+            }
+            this->packet_length -= MOCK_UART_HEADER + length;
+            memmove(this->packet, this->packet + MOCK_UART_HEADER + length, this->packet_length);
+        }
+        if (wait)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief      Moves the bytes that have arrived by now off the line into the receive ring
+ */
+void MockUart::pump()
+{
+    if (this->socket < 0)
+    {
+        return;
+    }
+
+    // Time stands still while the link is looked at
+    uint64_t const entered = mockTime();
+    uint64_t const time = now();
+    receive(false);
+    if (this->peer_time < time)
+    {
+        // Anything the other node sends from now on could still arrive before this time
+        sendPacket(time, nullptr, 0);
+        this->published = time;
+        while (this->peer_time < time)
+        {
+            receive(true);
+        }
+    }
+    else if (time - this->published >= MOCK_UART_QUANTUM_US * 1000ULL)
+    {
+        sendPacket(time, nullptr, 0);
+        this->published = time;
+    }
+
+    uint64_t const byte_time = byteTime();
+    while (this->pending_count > 0)
+    {
+        uint64_t const start = max(this->pending_sent[this->pending_head], this->line_free);
+        if (start + byte_time > time)
+        {
+            break;
+        }
+        this->line_free = start + byte_time;
+        uint8_t const c = this->pending[this->pending_head];
+        this->pending_head = (this->pending_head + 1) % this->pending_capacity;
+        this->pending_count--;
+        if (this->ring_count == MOCK_UART_RING_SIZE)
+        {
+            this->dropped++;
+            continue;
+        }
+        this->ring[(this->ring_head + this->ring_count) % MOCK_UART_RING_SIZE] = c;
+        this->ring_count++;
+    }
+    mockExclude(mockTime() - entered);
+}
+
+int MockUart::available()
+{
+    pump();
+    return this->ring_count;
+}
+
+int MockUart::read()
+{
+    pump();
+    if (this->ring_count == 0)
+    {
+        return -1;
+    }
+    uint8_t const c = this->ring[this->ring_head];
+    this->ring_head = (this->ring_head + 1) % MOCK_UART_RING_SIZE;
+    this->ring_count--;
+    return c;
+}
+
+int MockUart::peek()
+{
+    pump();
+    return this->ring_count > 0 ? this->ring[this->ring_head] : -1;
+}
+
+int MockUart::availableForWrite()
+{
+    uint64_t const time = now();
+    uint64_t const queued = this->tx_free > time ? (this->tx_free - time + byteTime() - 1) / byteTime() : 0;
+    return queued < MOCK_UART_RING_SIZE - 1 ? MOCK_UART_RING_SIZE - 1 - queued : 0;
+}
+
+/**
+ * @brief      Answers an AT command byte sent while the KEY pin is high, as the HC-05 does
+ *
+ * @param      c     Byte of the command
+ */
+void MockUart::answerAT(uint8_t c)
+{
+    if (c != '\n')
+    {
+        this->command_length += c != '\r';
+        return;
+    }
+    this->command_length = 0;
+    char const answer[] = "OK\r\n";
+    for (uint8_t i = 0; i < 4 && this->ring_count < MOCK_UART_RING_SIZE; ++i)
+    {
+        this->ring[(this->ring_head + this->ring_count) % MOCK_UART_RING_SIZE] = answer[i];
+        this->ring_count++;
+    }
+}
+
+size_t MockUart::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t MockUart::write(uint8_t const buffer[], size_t size)
+{
+    if (digitalRead(MOCK_UART_KEY_PIN) == HIGH)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            answerAT(buffer[i]);
+        }
+        return size;
+    }
+    if (this->socket < 0)
+    {
+        return size;
+    }
+
+    uint64_t const entered = mockTime();
+    uint64_t const time = now();
+    uint64_t const byte_time = byteTime();
+    uint64_t const departure = max(time, this->tx_free);
+    for (size_t done = 0; done < size;)
+    {
+        uint16_t const length = min(size - done, (size_t)1024);
+        sendPacket(departure + done * byte_time, buffer + done, length);
+        done += length;
+    }
+    mockExclude(mockTime() - entered);
+    this->tx_free = departure + size * byte_time;
+
+    // Writing returns once the rest fits into the transmit ring
+    uint64_t const fits = this->tx_free - (MOCK_UART_RING_SIZE - 1) * byte_time;
+    if (this->tx_free > (MOCK_UART_RING_SIZE - 1) * byte_time && fits > time)
+    {
+        mockWait((fits - time) / 1000);
+    }
+    return size;
+}
+
+void MockUart::flush()
+{
+    uint64_t const time = now();
+    if (this->tx_free > time)
+    {
+        mockWait((this->tx_free - time) / 1000);
+    }
+}
+
+uint32_t MockUart::getDropped()
+{
+    return this->dropped;
+}
@@ -0,0 +1,83 @@
+#ifndef MockUart_h
+#define MockUart_h
+
+// UART between the Mega and the HC-05, with the node at the other end of the link
+// running in another process behind a socket.
+//
+// Bytes leave at the baud rate, and writing blocks while the transmit ring is full.
+// They arrive no earlier than they were sent and are dropped once the receive ring
+// is full, just like in the 64-byte rings of HardwareSerial. The nodes keep their own
+// times, so a node only looks at the link once the other one has caught up with it,
+// which makes transfers take the same time however the host schedules the processes.
+
+// Size of the rings of HardwareSerial on the Mega
+#ifndef MOCK_UART_RING_SIZE
+#define MOCK_UART_RING_SIZE 64
+#endif
+// Pin holding the HC-05 in AT mode, see HC05_KEY_PIN of Network
+#ifndef MOCK_UART_KEY_PIN
+#define MOCK_UART_KEY_PIN 9
+#endif
+// Microseconds a node runs ahead before telling the other node its time
+#ifndef MOCK_UART_QUANTUM_US
+#define MOCK_UART_QUANTUM_US 200
+#endif
+
+class MockUart : public HardwareSerial
+{
+public:
+    MockUart();
+    // Connects to the socket of the other node with an idle line, -1 to leave the link unconnected
+    void connect(int socket);
+    void begin(unsigned long baud_rate) override;
+    int available() override;
+    int read() override;
+    int peek() override;
+    int availableForWrite() override;
+    size_t write(uint8_t c) override;
+    size_t write(uint8_t const buffer[], size_t size) override;
+    using Print::write;
+    void flush() override;
+    // Amount of bytes lost to a full receive ring
+    uint32_t getDropped();
+private:
+    uint64_t now();
+    uint64_t byteTime();
+    void pump();
+    void receive(bool wait);
+    void sendPacket(uint64_t time, uint8_t const data[], uint16_t length);
+    void answerAT(uint8_t c);
+    int socket;
+    unsigned long baud_rate;
+    /** @brief Time of this node when the link was connected */
+    uint64_t origin;
+    /** @brief Time the other node has reached at least, in link time */
+    uint64_t peer_time;
+    /** @brief Time last told to the other node */
+    uint64_t published;
+    /** @brief When the last byte written will have left */
+    uint64_t tx_free;
+    /** @brief Receive ring, as seen by the sketch */
+    uint8_t ring[MOCK_UART_RING_SIZE];
+    uint16_t ring_head;
+    uint16_t ring_count;
+    /** @brief Bytes sent by the other node that are still on the line, with the time they were sent */
+    uint8_t *pending;
+    uint64_t *pending_sent;
+    uint32_t pending_head;
+    uint32_t pending_count;
+    uint32_t pending_capacity;
+    /** @brief Partial packet read from the socket */
+    uint8_t packet[10 + 1024];
+    uint16_t packet_length;
+    /** @brief When the line finishes delivering the last byte taken off it */
+    uint64_t line_free;
+    /** @brief Length of the AT command being received while the KEY pin is high */
+    uint8_t command_length;
+    uint32_t dropped;
+};
+
+// Link used as NETWORK_SERIAL by the benchmark build
+extern MockUart BenchLink;
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SdFat_h
+#define SdFat_h
+
+// Host stand-in for the parts of SdFat 1.x used by Storage, over an in-memory FAT volume.
+// Card accesses take as long as on a class 10 card behind the software SPI of the Mega,
+// see mockWait, so that timings taken against the mock are comparable between builds.
+
+#include "Arduino.h"
+
+// Latencies of the card in microseconds
+#ifndef MOCK_SD_OPEN_US
+#define MOCK_SD_OPEN_US 800
+#endif
+#ifndef MOCK_SD_BLOCK_READ_US
+#define MOCK_SD_BLOCK_READ_US 350
+#endif
+#ifndef MOCK_SD_BLOCK_WRITE_US
+#define MOCK_SD_BLOCK_WRITE_US 700
+#endif
+// Raw blocks are streamed without a command per block
+#ifndef MOCK_SD_RAW_BLOCK_US
+#define MOCK_SD_RAW_BLOCK_US 400
+#endif
+// Allocating a cluster updates both FATs, and sometimes stalls while the card erases
+#ifndef MOCK_SD_CLUSTER_US
+#define MOCK_SD_CLUSTER_US 3000
+#endif
+#ifndef MOCK_SD_CLUSTER_SIZE
+#define MOCK_SD_CLUSTER_SIZE 4096
+#endif
+
+#define O_READ 0x01
+#define O_RDONLY O_READ
+#define O_WRITE 0x02
+#define O_WRONLY O_WRITE
+#define O_RDWR (O_READ | O_WRITE)
+#define O_AT_END 0x04
+#define O_APPEND O_AT_END
+#define O_TRUNC 0x10
+#define O_CREAT 0x20
+#define O_EXCL 0x40
+#define FILE_READ O_READ
+#define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+
+struct dir_t
+{
+    uint16_t lastWriteDate;
+    uint16_t lastWriteTime;
+    uint32_t fileSize;
+};
+
+struct MockSdNode;
+
+class FatFile
+{
+public:
+    FatFile();
+    bool open(FatFile *directory, char const path[], uint8_t mode);
+    bool open(FatFile *directory, uint16_t index, uint8_t mode);
+    bool createContiguous(FatFile *directory, char const path[], uint32_t size);
+    bool contiguousRange(uint32_t *first_block, uint32_t *last_block);
+    bool dirEntry(dir_t *entry);
+    uint16_t dirIndex();
+    bool isDir() const;
+    bool isOpen() const;
+    bool truncate(uint32_t length);
+    bool sync();
+    bool close();
+protected:
+    friend class MockSdFat;
+    MockSdNode *node;
+    uint32_t pos;
+    uint8_t mode;
+    uint16_t next_index;
+};
+
+class File : public FatFile, public Stream
+{
+public:
+    File() {}
+    operator bool() const;
+    bool seek(uint32_t position);
+    bool seekEnd(int32_t offset = 0);
+    uint32_t position();
+    uint32_t size();
+    int available() override;
+    int read() override;
+    int peek() override;
+    int read(void *buffer, size_t amount);
+    size_t write(uint8_t c) override;
+    size_t write(uint8_t const buffer[], size_t size) override;
+    using Print::write;
+    void flush() override;
+    bool getName(char name[], size_t size);
+    bool isDirectory();
+    File openNextFile(uint8_t mode = O_READ);
+    void rewindDirectory();
+    void close();
+};
+
+class SdSpiCard
+{
+public:
+    bool writeStart(uint32_t block, uint32_t count);
+    bool writeData(uint8_t const data[]);
+    bool writeStop();
+};
+
+class MockSdFat
+{
+public:
+    bool begin(uint8_t chip_select);
+    File open(char const path[], uint8_t mode = FILE_READ);
+    bool exists(char const path[]);
+    bool mkdir(char const path[], bool parents = true);
+    bool remove(char const path[]);
+    bool rename(char const old_path[], char const new_path[]);
+    FatFile *vwd();
+    SdSpiCard *card();
+    // Removes every file, and times card accesses only while timing is set
+    void format();
+    void setTiming(bool timing);
+};
+
+#endif